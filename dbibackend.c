@@ -2,9 +2,10 @@
  * DBI Backend - USB backend for Nintendo Switch DBI installer
  * Rewritten from Python to C
  * Requires: libusb-1.0
- * Compile: gcc -o dbibackend dbibackend.c -lusb-1.0
+ * Compile: gcc -pthread -o dbibackend dbibackend.c -lusb-1.0
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,13 +16,109 @@
 #include <sys/stat.h>
 #include <libusb-1.0/libusb.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/socket.h>
+#else
+#include <windows.h>
+#include <io.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <wmmintrin.h>
+#define HAVE_AESNI
+#endif
+#endif
+
+/* Hotplug notifications arrived in libusb 1.0.16 */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+#define HAVE_USB_HOTPLUG
+#endif
 
 #define BUFFER_SEGMENT_DATA_SIZE 0x100000
 #define SWITCH_VID 0x057E
 #define SWITCH_PID 0x3000
 #define USB_TIMEOUT 0
 #define MAX_PATH_LEN 4096
-#define MAX_TITLES 1024
+#define USB_DEFAULT_QUEUE_DEPTH 8
+#define USB_MAX_QUEUE_DEPTH 64
+#define USB_MAX_FAULTS 4
+#define DEFAULT_READ_BUFFERS 4
+#define MAX_READ_BUFFERS 64
+#define DIRECT_IO_ALIGN 4096
+#define PREFETCH_MAX_SIZE (16 * 1024 * 1024)
+#define PREFETCH_TRACKED_FILES MAX_CONSOLES
+#define PREFETCH_LAYOUT_JOBS 8
+#define FD_CACHE_DEFAULT_SIZE 16
+#define FD_CACHE_MAX_SIZE 1024
+#define FD_CACHE_REVALIDATE_SECS 2
+#define LIBRARY_FRESH_SECS 2
+#define BLOCK_CACHE_BLOCK_SIZE (64 * 1024)
+#define BLOCK_CACHE_SHARDS 16
+#define BLOCK_CACHE_DEFAULT_MB 64
+#define BLOCK_CACHE_MAX_MB 65536
+#define BLOCK_CACHE_MAX_RANGE (256 * 1024)
+#define PFS0_ENTRY_SIZE 0x18
+#define HFS0_ENTRY_SIZE 0x40
+#define XCI_HEADER_SIZE 0x200
+#define XCI_MAX_PARTITIONS 8
+#define NCA_HEADER_SIZE 0xC00
+#define CONTAINER_MAX_ENTRIES 256
+#define NCZ_HEADER_SIZE 0x4000
+#define NCZ_SECTION_SIZE 0x40
+#define NCZ_MAX_SECTIONS 64
+#define NCZ_MIN_BLOCK_SHIFT 14
+#define NCZ_MAX_BLOCK_SHIFT 24
+#define NCZ_CRYPTO_CTR 3
+#define NCZ_CRYPTO_BKTR 4
+#define DECOMPRESSED_TITLES 8
+#define DEFAULT_DECOMPRESS_THREADS 4
+#define MAX_DECOMPRESS_THREADS 64
+#define SPLIT_MAX_PARTS 100
+#define SPLIT_CACHE_SIZE 16
+#define DEFAULT_SCAN_THREADS 4
+#define MAX_SCAN_THREADS 64
+#define MAX_CONSOLES 16
+#define SIM_RANGE_SIZE (8 * 1024 * 1024)
+#define LIBRARY_WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/* Modification time of a struct stat; Windows only keeps whole seconds */
+#ifdef __APPLE__
+#define STAT_MTIME(st) ((st).st_mtimespec)
+#elif defined(_WIN32)
+#define STAT_MTIME(st) ((struct timespec){ .tv_sec = (st).st_mtime, .tv_nsec = 0 })
+#else
+#define STAT_MTIME(st) ((st).st_mtim)
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef _WIN32
+/* Positional read on a CRT descriptor; the file offset is left alone */
+static ssize_t pread(int fd, void *buf, size_t count, uint64_t offset) {
+    OVERLAPPED ov = {0};
+    DWORD n;
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    if (!ReadFile((HANDLE)_get_osfhandle(fd), buf, (DWORD)count, &n, &ov)) {
+        return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+    }
+    return n;
+}
+#endif
 
 /* Command IDs */
 typedef enum {
@@ -38,28 +135,122 @@ typedef enum {
     CMD_TYPE_ACK = 2
 } CommandType;
 
-/* USB Context */
+/* Asynchronous bulk OUT transfer slot */
+typedef struct UsbTxRing UsbTxRing;
+
 typedef struct {
+    struct libusb_transfer *transfer;
+    uint8_t *buffer;
+    bool dev_mem;
+    uint32_t skew;
+    uint32_t filled;
+    int idle;
+    UsbTxRing *ring;
+} UsbTxSlot;
+
+/* Ring of OUT transfers kept in flight while streaming a reply.
+ * The lock guards slot state shared with the file reader thread. */
+struct UsbTxRing {
+    UsbTxSlot *slots;
+    uint64_t generation;
+    int size;
+    int depth;
+    int next;
+    int error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+typedef struct UsbContext UsbContext;
+
+/* Byte transport carrying the DBI protocol. The libusb transport talks to
+ * a Switch; the socket transport lets the simulated client drive the same
+ * command loop. Errors are libusb error codes, and submit completes its
+ * ring slot through usb_tx_complete(). */
+typedef struct {
+    const char *name;
+    int (*read)(UsbContext *ctx, uint8_t *data, int size, int timeout);
+    int (*write)(UsbContext *ctx, uint8_t *data, int size, int timeout);
+    int (*submit)(UsbContext *ctx, UsbTxSlot *slot, uint8_t *data, int size);
+    void (*close)(UsbContext *ctx);
+} Transport;
+
+/* USB Context */
+struct UsbContext {
+    const Transport *transport;
     libusb_context *ctx;
     libusb_device_handle *dev_handle;
+    int fd;
     uint8_t ep_in;
     uint8_t ep_out;
-} UsbContext;
+    bool own_ctx;
+    int faults;
+    bool lost;
+    UsbTxRing tx;
+};
+
+/* Directory in the title index. Each directory stores only its own name
+ * and its parent, so full paths share their common prefixes. */
+typedef struct {
+    uint32_t parent;
+    uint32_t name;
+} TitleDir;
 
-/* Title cache entry */
+/* Title index entry: display name and containing directory */
 typedef struct {
-    char display_name[256];
-    char full_path[MAX_PATH_LEN];
+    uint32_t dir;
+    uint32_t name;
 } TitleEntry;
 
-/* Title cache */
+/* Title index. Names live in one string arena referenced by offset; an
+ * open-addressing hash of display names holds entry index + 1, with zero
+ * marking an empty bucket. Every change to the index bumps its generation;
+ * the LIST payload is cached together with the generation it was built
+ * from. */
 typedef struct {
-    TitleEntry entries[MAX_TITLES];
-    int count;
-} TitleCache;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+    TitleDir *dirs;
+    uint32_t dir_count;
+    uint32_t dir_cap;
+    TitleEntry *entries;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *buckets;
+    uint32_t bucket_count;
+    uint64_t generation;
+    size_t list_len;
+    char *list_payload;
+    size_t list_payload_len;
+    uint64_t list_payload_generation;
+    bool list_changed;
+} TitleIndex;
 
 /* Global variables */
 static bool debug_mode = false;
+static int usb_queue_depth = USB_DEFAULT_QUEUE_DEPTH;
+static int read_buffers = DEFAULT_READ_BUFFERS;
+#ifndef _WIN32
+static bool use_mmap = false;
+#endif
+#ifdef HAVE_LIBURING
+static bool use_io_uring = false;
+#endif
+static bool use_direct_io = false;
+static bool use_prefetch = false;
+static int fd_cache_size = FD_CACHE_DEFAULT_SIZE;
+static int block_cache_mb = BLOCK_CACHE_DEFAULT_MB;
+static bool use_prewarm = false;
+#ifdef HAVE_ZSTD
+static bool use_decompress = false;
+static int decompress_threads = DEFAULT_DECOMPRESS_THREADS;
+#endif
+static int scan_threads = DEFAULT_SCAN_THREADS;
+static const char *index_file_path = NULL;
+static bool use_hotplug = false;
+static bool multi_console = false;
+static int simulate_passes = 0;
 
 /* Logging functions */
 #define LOG_INFO(fmt, ...) printf("[INFO] " fmt "\n", ##__VA_ARGS__)
@@ -67,62 +258,400 @@ static bool debug_mode = false;
 #define LOG_ERROR(fmt, ...) fprintf(stderr, "[ERROR] " fmt "\n", ##__VA_ARGS__)
 #define LOG_WARNING(fmt, ...) fprintf(stderr, "[WARNING] " fmt "\n", ##__VA_ARGS__)
 
-/* USB functions */
+/* What a failed transfer says about the link to the Switch */
+typedef enum {
+    USB_FAULT_RETRY,    /* timed out or interrupted, the pipe is fine */
+    USB_FAULT_HALT,     /* endpoint stalled, clear the halt */
+    USB_FAULT_RECLAIM,  /* transfer error, claim the interface again */
+    USB_FAULT_GONE      /* the Switch is no longer there */
+} UsbFault;
+
+static UsbFault usb_classify_error(int error) {
+    switch (error) {
+        case LIBUSB_ERROR_TIMEOUT:
+        case LIBUSB_ERROR_INTERRUPTED:
+            return USB_FAULT_RETRY;
+        case LIBUSB_ERROR_PIPE:
+            return USB_FAULT_HALT;
+        case LIBUSB_ERROR_NO_DEVICE:
+            return USB_FAULT_GONE;
+        default:
+            return USB_FAULT_RECLAIM;
+    }
+}
+
+/* Resync both pipes without re-enumerating the device */
+static int usb_reclaim(UsbContext *ctx) {
+    libusb_release_interface(ctx->dev_handle, 0);
+    int ret = libusb_claim_interface(ctx->dev_handle, 0);
+    if (ret == 0) {
+        libusb_clear_halt(ctx->dev_handle, ctx->ep_in);
+        ret = libusb_clear_halt(ctx->dev_handle, ctx->ep_out);
+    }
+    if (ret < 0) {
+        LOG_ERROR("Failed to re-claim interface: %s", libusb_error_name(ret));
+        return -1;
+    }
+    LOG_WARNING("Re-claimed USB interface");
+    return 0;
+}
+
+/* Recover from a failed command read on endpoint. Returns 0 when the
+ * session can go on, -1 once the Switch has to be reconnected. Too many
+ * faults without a command getting through count as a lost link. */
+static int usb_recover(UsbContext *ctx, uint8_t endpoint, int error) {
+    if (!ctx->lost && ++ctx->faults > USB_MAX_FAULTS) {
+        LOG_ERROR("Giving up after %d USB errors in a row", USB_MAX_FAULTS);
+        ctx->lost = true;
+    }
+    if (ctx->lost) {
+        return -1;
+    }
+
+    UsbFault fault = usb_classify_error(error);
+    if (fault == USB_FAULT_HALT) {
+        int ret = libusb_clear_halt(ctx->dev_handle, endpoint);
+        if (ret == 0) {
+            LOG_WARNING("Cleared stall on endpoint 0x%02x", endpoint);
+            return 0;
+        }
+        fault = usb_classify_error(ret) == USB_FAULT_GONE ? USB_FAULT_GONE : USB_FAULT_RECLAIM;
+    }
+    if (fault == USB_FAULT_RECLAIM && usb_reclaim(ctx) < 0) {
+        fault = USB_FAULT_GONE;
+    }
+    if (fault == USB_FAULT_GONE) {
+        ctx->lost = true;
+        return -1;
+    }
+    return 0;
+}
+
+/* USB functions. These run inside a command, where a failed transfer
+ * leaves the Switch waiting on the rest of the exchange: the session is
+ * lost and the device is reset on reconnect. */
 int usb_read(UsbContext *ctx, uint8_t *data, int size, int timeout) {
-    int transferred;
-    int ret = libusb_bulk_transfer(ctx->dev_handle, ctx->ep_in, data, size, &transferred, timeout);
+    int ret = ctx->transport->read(ctx, data, size, timeout);
     if (ret < 0) {
         LOG_ERROR("USB read error: %s", libusb_error_name(ret));
-        return ret;
+        ctx->lost = true;
     }
-    return transferred;
+    return ret;
 }
 
 int usb_write(UsbContext *ctx, uint8_t *data, int size, int timeout) {
+    int ret = ctx->transport->write(ctx, data, size, timeout);
+    if (ret < 0) {
+        LOG_ERROR("USB write error: %s", libusb_error_name(ret));
+        ctx->lost = true;
+    }
+    return ret;
+}
+
+/* Mark a ring slot reusable, keeping the first error the ring sees */
+static void usb_tx_complete(UsbTxSlot *slot, int error) {
+    pthread_mutex_lock(&slot->ring->lock);
+    if (error < 0 && !slot->ring->error) {
+        slot->ring->error = error;
+    }
+    slot->idle = 1;
+    pthread_cond_broadcast(&slot->ring->cond);
+    pthread_mutex_unlock(&slot->ring->lock);
+}
+
+/* Completion callback: marks the slot reusable and records failures */
+static void LIBUSB_CALL usb_tx_callback(struct libusb_transfer *transfer) {
+    UsbTxSlot *slot = transfer->user_data;
+    int error = 0;
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+        transfer->actual_length != transfer->length) {
+        LOG_ERROR("USB async write failed: status %d, %d/%d bytes",
+                  transfer->status, transfer->actual_length, transfer->length);
+        switch (transfer->status) {
+            case LIBUSB_TRANSFER_NO_DEVICE:
+                error = LIBUSB_ERROR_NO_DEVICE;
+                break;
+            case LIBUSB_TRANSFER_STALL:
+                error = LIBUSB_ERROR_PIPE;
+                break;
+            case LIBUSB_TRANSFER_TIMED_OUT:
+                error = LIBUSB_ERROR_TIMEOUT;
+                break;
+            default:
+                error = LIBUSB_ERROR_IO;
+                break;
+        }
+    }
+    usb_tx_complete(slot, error);
+}
+
+/* libusb transport: bulk transfers on the claimed DBI interface */
+static int usb_bulk_read(UsbContext *ctx, uint8_t *data, int size, int timeout) {
+    int transferred;
+    int ret = libusb_bulk_transfer(ctx->dev_handle, ctx->ep_in, data, size, &transferred, timeout);
+    return ret < 0 ? ret : transferred;
+}
+
+static int usb_bulk_write(UsbContext *ctx, uint8_t *data, int size, int timeout) {
     int transferred;
     int ret = libusb_bulk_transfer(ctx->dev_handle, ctx->ep_out, data, size, &transferred, timeout);
+    return ret < 0 ? ret : transferred;
+}
+
+static int usb_bulk_submit(UsbContext *ctx, UsbTxSlot *slot, uint8_t *data, int size) {
+    libusb_fill_bulk_transfer(slot->transfer, ctx->dev_handle, ctx->ep_out,
+                              data, size, usb_tx_callback, slot, USB_TIMEOUT);
+    return libusb_submit_transfer(slot->transfer);
+}
+
+static void usb_device_close(UsbContext *ctx) {
+    if (ctx->dev_handle) {
+        libusb_release_interface(ctx->dev_handle, 0);
+        libusb_close(ctx->dev_handle);
+    }
+    if (ctx->ctx && ctx->own_ctx) {
+        libusb_exit(ctx->ctx);
+    }
+}
+
+static const Transport usb_transport = {
+    "libusb", usb_bulk_read, usb_bulk_write, usb_bulk_submit, usb_device_close
+};
+
+#ifndef _WIN32
+/* Socket transport: a stream socket carries the same bytes as the bulk
+ * pipes. Every failure reads as an unplugged device, and writes complete
+ * before submit returns. */
+static int sock_transfer(int fd, uint8_t *data, int size, bool out) {
+    int done = 0;
+    while (done < size) {
+        ssize_t n = out ? send(fd, data + done, size - done, MSG_NOSIGNAL) :
+                          recv(fd, data + done, size - done, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return LIBUSB_ERROR_NO_DEVICE;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static int sock_read(UsbContext *ctx, uint8_t *data, int size, int timeout) {
+    (void)timeout;
+    return sock_transfer(ctx->fd, data, size, false);
+}
+
+static int sock_write(UsbContext *ctx, uint8_t *data, int size, int timeout) {
+    (void)timeout;
+    return sock_transfer(ctx->fd, data, size, true);
+}
+
+static int sock_submit(UsbContext *ctx, UsbTxSlot *slot, uint8_t *data, int size) {
+    int ret = sock_transfer(ctx->fd, data, size, true);
     if (ret < 0) {
-        LOG_ERROR("USB write error: %s", libusb_error_name(ret));
         return ret;
     }
-    return transferred;
+    usb_tx_complete(slot, 0);
+    return 0;
 }
 
-UsbContext* usb_init(uint16_t vid, uint16_t pid) {
-    UsbContext *ctx = malloc(sizeof(UsbContext));
-    if (!ctx) {
-        LOG_ERROR("Failed to allocate USB context");
+static void sock_close(UsbContext *ctx) {
+    close(ctx->fd);
+}
+
+static const Transport socket_transport = {
+    "socket", sock_read, sock_write, sock_submit, sock_close
+};
+#endif
+
+/* Allocate a transfer buffer, preferring usbfs-mapped device memory so the
+ * kernel can skip copying each transfer out of user space */
+static uint8_t* usb_tx_buffer_alloc(UsbContext *ctx, bool *dev_mem) {
+    *dev_mem = false;
+#ifdef __linux__
+    /* O_DIRECT cannot read into usbfs mappings, so use aligned heap memory */
+    if (use_direct_io) {
+        void *buffer = NULL;
+        return posix_memalign(&buffer, DIRECT_IO_ALIGN, BUFFER_SEGMENT_DATA_SIZE) == 0 ? buffer : NULL;
+    }
+#endif
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    uint8_t *buffer = ctx->dev_handle ?
+                      libusb_dev_mem_alloc(ctx->dev_handle, BUFFER_SEGMENT_DATA_SIZE) : NULL;
+    if (buffer) {
+        *dev_mem = true;
+        return buffer;
+    }
+#else
+    (void)ctx;
+#endif
+    return malloc(BUFFER_SEGMENT_DATA_SIZE);
+}
+
+static void usb_tx_buffer_free(UsbContext *ctx, UsbTxSlot *slot) {
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    if (slot->dev_mem) {
+        libusb_dev_mem_free(ctx->dev_handle, slot->buffer, BUFFER_SEGMENT_DATA_SIZE);
+        return;
+    }
+#else
+    (void)ctx;
+#endif
+    free(slot->buffer);
+}
+
+/* Allocate the OUT transfer ring: depth transfers may be in flight while
+ * the reader fills up to buffers more slots ahead of them. Every ring gets
+ * a new generation, so buffers registered for an earlier ring are never
+ * mistaken for its own even when the allocation lands at the same address. */
+int usb_tx_ring_init(UsbContext *ctx, int depth, int buffers) {
+    static uint64_t generations;
+    UsbTxRing *ring = &ctx->tx;
+    int size = depth + buffers;
+    ring->slots = calloc(size, sizeof(UsbTxSlot));
+    if (!ring->slots) {
+        LOG_ERROR("Failed to allocate USB transfer ring");
+        return -1;
+    }
+    ring->generation = __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+    ring->size = size;
+    ring->depth = depth;
+    ring->next = 0;
+    ring->error = 0;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->cond, NULL);
+
+    int dev_mem_slots = 0;
+    for (int i = 0; i < size; i++) {
+        UsbTxSlot *slot = &ring->slots[i];
+        slot->ring = ring;
+        slot->idle = 1;
+        slot->transfer = libusb_alloc_transfer(0);
+        slot->buffer = usb_tx_buffer_alloc(ctx, &slot->dev_mem);
+        if (!slot->transfer || !slot->buffer) {
+            LOG_ERROR("Failed to allocate USB transfer slot");
+            return -1;
+        }
+        if (slot->dev_mem) {
+            dev_mem_slots++;
+        }
+    }
+
+    LOG_DEBUG("USB transfer ring: %d x %d bytes, %d in flight, %d in device memory",
+              size, BUFFER_SEGMENT_DATA_SIZE, depth, dev_mem_slots);
+    return 0;
+}
+
+void usb_tx_ring_free(UsbContext *ctx) {
+    UsbTxRing *ring = &ctx->tx;
+    if (!ring->slots) {
+        return;
+    }
+    for (int i = 0; i < ring->size; i++) {
+        if (ring->slots[i].transfer) {
+            libusb_free_transfer(ring->slots[i].transfer);
+        }
+        if (ring->slots[i].buffer) {
+            usb_tx_buffer_free(ctx, &ring->slots[i]);
+        }
+    }
+    free(ring->slots);
+    ring->slots = NULL;
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->cond);
+}
+
+/* Read a slot's idle flag. With several consoles sharing one libusb
+ * context, the completion callback may run on another session's thread. */
+static bool usb_tx_slot_idle(UsbTxSlot *slot) {
+    pthread_mutex_lock(&slot->ring->lock);
+    bool idle = slot->idle;
+    pthread_mutex_unlock(&slot->ring->lock);
+    return idle;
+}
+
+/* Block until the slot's transfer has completed */
+static int usb_tx_wait_slot(UsbContext *ctx, UsbTxSlot *slot) {
+    while (!usb_tx_slot_idle(slot)) {
+        int ret = libusb_handle_events_completed(ctx->ctx, &slot->idle);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+            LOG_ERROR("USB event handling error: %s", libusb_error_name(ret));
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Take the next slot in ring order, waiting for its previous transfer */
+UsbTxSlot* usb_tx_acquire(UsbContext *ctx) {
+    UsbTxRing *ring = &ctx->tx;
+    UsbTxSlot *slot = &ring->slots[ring->next];
+    if (usb_tx_wait_slot(ctx, slot) < 0) {
         return NULL;
     }
+    pthread_mutex_lock(&ring->lock);
+    int error = ring->error;
+    pthread_mutex_unlock(&ring->lock);
+    if (error) {
+        return NULL;
+    }
+    ring->next = (ring->next + 1) % ring->depth;
+    return slot;
+}
 
-    int ret = libusb_init(&ctx->ctx);
+/* Queue size bytes of data as a bulk OUT transfer on the given slot */
+int usb_tx_submit(UsbContext *ctx, UsbTxSlot *slot, uint8_t *data, int size) {
+    pthread_mutex_lock(&ctx->tx.lock);
+    slot->idle = 0;
+    pthread_mutex_unlock(&ctx->tx.lock);
+    int ret = ctx->transport->submit(ctx, slot, data, size);
     if (ret < 0) {
-        LOG_ERROR("Failed to initialize libusb: %s", libusb_error_name(ret));
-        free(ctx);
-        return NULL;
+        LOG_ERROR("USB submit error: %s", libusb_error_name(ret));
+        usb_tx_complete(slot, ret);
+        return ret;
     }
+    return size;
+}
 
-    ctx->dev_handle = libusb_open_device_with_vid_pid(ctx->ctx, vid, pid);
-    if (!ctx->dev_handle) {
-        LOG_ERROR("Device %04x:%04x not found", vid, pid);
-        libusb_exit(ctx->ctx);
-        free(ctx);
-        return NULL;
+/* Wait for every outstanding transfer; returns and clears the ring error.
+ * A failed transfer cuts a reply short, so it loses the session. */
+int usb_tx_flush(UsbContext *ctx) {
+    UsbTxRing *ring = &ctx->tx;
+    for (int i = 0; i < ring->size; i++) {
+        int ret = usb_tx_wait_slot(ctx, &ring->slots[i]);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    pthread_mutex_lock(&ring->lock);
+    int error = ring->error;
+    ring->error = 0;
+    pthread_mutex_unlock(&ring->lock);
+    ring->next = 0;
+    if (error < 0) {
+        ctx->lost = true;
+    }
+    return error;
+}
+
+/* Claim the DBI interface of an opened device and set up the transfer ring.
+ * Devices that have just enumerated are in a clean state and skip the reset. */
+static int usb_setup_device(UsbContext *ctx, bool reset) {
+    ctx->transport = &usb_transport;
+    if (reset) {
+        libusb_reset_device(ctx->dev_handle);
     }
 
-    libusb_reset_device(ctx->dev_handle);
-    
     if (libusb_kernel_driver_active(ctx->dev_handle, 0) == 1) {
         libusb_detach_kernel_driver(ctx->dev_handle, 0);
     }
 
-    ret = libusb_claim_interface(ctx->dev_handle, 0);
+    int ret = libusb_claim_interface(ctx->dev_handle, 0);
     if (ret < 0) {
         LOG_ERROR("Failed to claim interface: %s", libusb_error_name(ret));
-        libusb_close(ctx->dev_handle);
-        libusb_exit(ctx->ctx);
-        free(ctx);
-        return NULL;
+        return -1;
     }
 
     struct libusb_config_descriptor *config;
@@ -148,6 +677,41 @@ UsbContext* usb_init(uint16_t vid, uint16_t pid) {
     if (ctx->ep_in == 0 || ctx->ep_out == 0) {
         LOG_ERROR("Failed to find endpoints");
         libusb_release_interface(ctx->dev_handle, 0);
+        return -1;
+    }
+
+    if (usb_tx_ring_init(ctx, usb_queue_depth, read_buffers) < 0) {
+        usb_tx_ring_free(ctx);
+        libusb_release_interface(ctx->dev_handle, 0);
+        return -1;
+    }
+    return 0;
+}
+
+UsbContext* usb_init(uint16_t vid, uint16_t pid) {
+    UsbContext *ctx = calloc(1, sizeof(UsbContext));
+    if (!ctx) {
+        LOG_ERROR("Failed to allocate USB context");
+        return NULL;
+    }
+
+    int ret = libusb_init(&ctx->ctx);
+    if (ret < 0) {
+        LOG_ERROR("Failed to initialize libusb: %s", libusb_error_name(ret));
+        free(ctx);
+        return NULL;
+    }
+    ctx->own_ctx = true;
+
+    ctx->dev_handle = libusb_open_device_with_vid_pid(ctx->ctx, vid, pid);
+    if (!ctx->dev_handle) {
+        LOG_ERROR("Device %04x:%04x not found", vid, pid);
+        libusb_exit(ctx->ctx);
+        free(ctx);
+        return NULL;
+    }
+
+    if (usb_setup_device(ctx, true) < 0) {
         libusb_close(ctx->dev_handle);
         libusb_exit(ctx->ctx);
         free(ctx);
@@ -157,127 +721,5079 @@ UsbContext* usb_init(uint16_t vid, uint16_t pid) {
     return ctx;
 }
 
-void usb_cleanup(UsbContext *ctx) {
-    if (ctx) {
-        if (ctx->dev_handle) {
-            libusb_release_interface(ctx->dev_handle, 0);
-            libusb_close(ctx->dev_handle);
+/* Open a Switch found by enumeration or hotplug on a shared libusb context */
+static UsbContext* usb_open_device(libusb_context *usb, libusb_device *device, bool reset) {
+    UsbContext *ctx = calloc(1, sizeof(UsbContext));
+    if (!ctx) {
+        LOG_ERROR("Failed to allocate USB context");
+        return NULL;
+    }
+    ctx->ctx = usb;
+    int ret = libusb_open(device, &ctx->dev_handle);
+    if (ret < 0) {
+        LOG_ERROR("Failed to open switch: %s", libusb_error_name(ret));
+        free(ctx);
+        return NULL;
+    }
+    if (usb_setup_device(ctx, reset) < 0) {
+        libusb_close(ctx->dev_handle);
+        free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+#ifdef HAVE_USB_HOTPLUG
+/* Hotplug mode: one libusb context for the life of the process, with
+ * consoles announced by the arrival callback instead of polled for. The
+ * callback runs from libusb event handling, on whichever thread is doing
+ * it, so the table of attached consoles has its own lock. */
+typedef struct {
+    libusb_device *device;
+    bool fresh;
+} UsbAttached;
+
+typedef struct {
+    libusb_context *ctx;
+    libusb_hotplug_callback_handle handle;
+    pthread_mutex_t lock;
+    UsbAttached attached[MAX_CONSOLES];
+    int attached_count;
+    bool enumerating;
+} UsbHotplug;
+
+static UsbHotplug usb_hotplug = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Drop an attached console; called with the hotplug lock held */
+static void usb_hotplug_forget(int i) {
+    libusb_unref_device(usb_hotplug.attached[i].device);
+    usb_hotplug.attached[i] = usb_hotplug.attached[--usb_hotplug.attached_count];
+}
+
+static int LIBUSB_CALL usb_hotplug_callback(libusb_context *ctx, libusb_device *device,
+                                            libusb_hotplug_event event, void *user_data) {
+    (void)ctx;
+    (void)user_data;
+    pthread_mutex_lock(&usb_hotplug.lock);
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+        if (usb_hotplug.attached_count < MAX_CONSOLES) {
+            UsbAttached *attached = &usb_hotplug.attached[usb_hotplug.attached_count++];
+            attached->device = libusb_ref_device(device);
+            /* Devices already present at startup may be left mid-session */
+            attached->fresh = !usb_hotplug.enumerating;
+            LOG_DEBUG("Switch arrived");
+        } else {
+            LOG_WARNING("Ignoring switch, %d already attached", MAX_CONSOLES);
         }
-        if (ctx->ctx) {
-            libusb_exit(ctx->ctx);
+    } else {
+        for (int i = 0; i < usb_hotplug.attached_count; i++) {
+            if (usb_hotplug.attached[i].device == device) {
+                usb_hotplug_forget(i);
+                LOG_DEBUG("Switch left");
+                break;
+            }
         }
-        free(ctx);
     }
+    pthread_mutex_unlock(&usb_hotplug.lock);
+    return 0;
 }
 
-/* Helper function to check if file has valid extension */
-bool has_valid_extension(const char *filename) {
-    size_t len = strlen(filename);
-    if (len < 4) return false;
-    
-    const char *ext = filename + len - 4;
-    return (strcasecmp(ext, ".nsp") == 0 || 
-            strcasecmp(ext, ".xci") == 0 ||
-            strcasecmp(ext, ".nsz") == 0);
+int usb_hotplug_start(void) {
+    int ret = libusb_init(&usb_hotplug.ctx);
+    if (ret < 0) {
+        LOG_ERROR("Failed to initialize libusb: %s", libusb_error_name(ret));
+        return -1;
+    }
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        LOG_WARNING("USB hotplug is not supported on this platform, polling instead");
+        libusb_exit(usb_hotplug.ctx);
+        usb_hotplug.ctx = NULL;
+        return -1;
+    }
+
+    usb_hotplug.enumerating = true;
+    ret = libusb_hotplug_register_callback(usb_hotplug.ctx,
+                                           LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                                           LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                           LIBUSB_HOTPLUG_ENUMERATE, SWITCH_VID, SWITCH_PID,
+                                           LIBUSB_HOTPLUG_MATCH_ANY, usb_hotplug_callback, NULL,
+                                           &usb_hotplug.handle);
+    usb_hotplug.enumerating = false;
+    if (ret < 0) {
+        LOG_WARNING("Failed to register USB hotplug callback: %s, polling instead",
+                    libusb_error_name(ret));
+        libusb_exit(usb_hotplug.ctx);
+        usb_hotplug.ctx = NULL;
+        return -1;
+    }
+    return 0;
 }
 
-/* Recursively scan directory for titles */
-void scan_directory(const char *path, TitleCache *cache) {
-    DIR *dir = opendir(path);
-    if (!dir) {
-        LOG_ERROR("Failed to open directory: %s", path);
+void usb_hotplug_stop(void) {
+    if (!usb_hotplug.ctx) {
         return;
     }
+    libusb_hotplug_deregister_callback(usb_hotplug.ctx, usb_hotplug.handle);
+    pthread_mutex_lock(&usb_hotplug.lock);
+    while (usb_hotplug.attached_count > 0) {
+        usb_hotplug_forget(0);
+    }
+    pthread_mutex_unlock(&usb_hotplug.lock);
+    libusb_exit(usb_hotplug.ctx);
+    usb_hotplug.ctx = NULL;
+}
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL && cache->count < MAX_TITLES) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-            continue;
+/* Take an attached console to serve, skipping those accepted already.
+ * Returns a referenced device and whether it still needs a reset. */
+static libusb_device* usb_hotplug_take(bool (*busy)(libusb_device*), bool *reset) {
+    libusb_device *device = NULL;
+    pthread_mutex_lock(&usb_hotplug.lock);
+    for (int i = 0; i < usb_hotplug.attached_count && !device; i++) {
+        UsbAttached *attached = &usb_hotplug.attached[i];
+        if (!busy || !busy(attached->device)) {
+            device = libusb_ref_device(attached->device);
+            *reset = !attached->fresh;
+            /* Whatever the session leaves behind, the next one resets */
+            attached->fresh = false;
         }
+    }
+    pthread_mutex_unlock(&usb_hotplug.lock);
+    return device;
+}
 
-        char full_path[MAX_PATH_LEN];
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
+/* A console that cannot be opened as it is waits to be plugged in again */
+static void usb_hotplug_reject(libusb_device *device) {
+    pthread_mutex_lock(&usb_hotplug.lock);
+    for (int i = 0; i < usb_hotplug.attached_count; i++) {
+        if (usb_hotplug.attached[i].device == device) {
+            usb_hotplug_forget(i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&usb_hotplug.lock);
+}
 
-        struct stat st;
-        if (stat(full_path, &st) == 0) {
-            if (S_ISDIR(st.st_mode)) {
-                LOG_DEBUG("Found directory: %s", full_path);
-                scan_directory(full_path, cache);
-            } else if (S_ISREG(st.st_mode) && has_valid_extension(entry->d_name)) {
-                LOG_DEBUG("\t%s", entry->d_name);
-                strncpy(cache->entries[cache->count].display_name, entry->d_name, 255);
-                strncpy(cache->entries[cache->count].full_path, full_path, MAX_PATH_LEN - 1);
-                cache->count++;
+/* Sleep in libusb until a Switch is attached, then open it */
+UsbContext* usb_hotplug_wait(void) {
+    bool waiting = false;
+    while (true) {
+        bool reset;
+        libusb_device *device = usb_hotplug_take(NULL, &reset);
+        if (!device) {
+            if (!waiting) {
+                LOG_INFO("Waiting for switch");
+                waiting = true;
             }
+            int ret = libusb_handle_events(usb_hotplug.ctx);
+            if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+                LOG_ERROR("Failed to wait for USB events: %s", libusb_error_name(ret));
+                return NULL;
+            }
+            continue;
         }
-    }
 
-    closedir(dir);
+        UsbContext *ctx = usb_open_device(usb_hotplug.ctx, device, reset);
+        if (!ctx) {
+            usb_hotplug_reject(device);
+        }
+        libusb_unref_device(device);
+        if (ctx) {
+            return ctx;
+        }
+    }
 }
+#endif
 
-/* Find title in cache by display name */
-const char* find_title_path(TitleCache *cache, const char *display_name) {
-    for (int i = 0; i < cache->count; i++) {
-        if (strcmp(cache->entries[i].display_name, display_name) == 0) {
-            return cache->entries[i].full_path;
-        }
+void usb_cleanup(UsbContext *ctx) {
+    if (ctx) {
+        usb_tx_ring_free(ctx);
+        ctx->transport->close(ctx);
+        free(ctx);
     }
-    return display_name;
 }
 
-/* Process EXIT command */
-void process_exit_command(UsbContext *ctx) {
-    LOG_INFO("Exit");
-    uint8_t response[16];
-    memcpy(response, "DBI0", 4);
-    *(uint32_t*)(response + 4) = CMD_TYPE_RESPONSE;
+/* Helper function to check if file has valid extension */
+bool has_valid_extension(const char *filename) {
+    size_t len = strlen(filename);
+    if (len < 4) return false;
+    
+    const char *ext = filename + len - 4;
+    return (strcasecmp(ext, ".nsp") == 0 || 
+            strcasecmp(ext, ".xci") == 0 ||
+            strcasecmp(ext, ".nsz") == 0 ||
+            strcasecmp(ext, ".xcz") == 0 ||
+            strcasecmp(ext, ".ns0") == 0 ||
+            strcasecmp(ext, ".xc0") == 0);
+}
+
+/* Map between the name of a title split into .ns0/.xc0, .ns1/.xc1, ...
+ * files and the name it is listed under: .ns0 to .nsp and .xc0 to .xci
+ * when listing, the other way round otherwise. Returns false for names
+ * with neither. */
+static bool split_title_name(const char *name, bool listing, char *out, size_t out_size) {
+    static const char *pairs[][2] = { { ".nsp", ".ns0" }, { ".xci", ".xc0" } };
+    size_t len = strlen(name);
+    if (len < 4 || len >= out_size) {
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (strcasecmp(name + len - 4, pairs[i][listing]) == 0) {
+            char last = pairs[i][!listing][3];
+            bool upper = name[len - 2] >= 'A' && name[len - 2] <= 'Z';
+            memcpy(out, name, len + 1);
+            out[len - 1] = upper && last >= 'a' ? last - 'a' + 'A' : last;
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef HAVE_ZSTD
+/* Map a title name between its compressed and decompressed extension:
+ * .nsp to .nsz and .xci to .xcz when compress is set, the other way
+ * round otherwise. Returns false for names with neither. */
+static bool swap_title_extension(const char *name, bool compress, char *out, size_t out_size) {
+    static const char *pairs[][2] = { { ".nsp", ".nsz" }, { ".xci", ".xcz" } };
+    size_t len = strlen(name);
+    if (len < 4 || len >= out_size) {
+        return false;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (strcasecmp(name + len - 4, pairs[i][!compress]) == 0) {
+            char last = pairs[i][compress][3];
+            memcpy(out, name, len + 1);
+            out[len - 1] = name[len - 1] >= 'A' && name[len - 1] <= 'Z' ? last - 'a' + 'A' : last;
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+/* FNV-1a hash of a title display name */
+static uint32_t title_name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char*)name; *p; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+static const char* title_index_str(TitleIndex *index, uint32_t offset) {
+    return index->arena + offset;
+}
+
+/* Grow an array to hold at least count + 1 elements */
+static bool grow_array(void **array, uint32_t *cap, uint32_t count, size_t elem_size) {
+    if (count < *cap) {
+        return true;
+    }
+    uint32_t new_cap = *cap ? *cap * 2 : 64;
+    void *grown = realloc(*array, new_cap * elem_size);
+    if (!grown) {
+        LOG_ERROR("Failed to grow title index");
+        return false;
+    }
+    *array = grown;
+    *cap = new_cap;
+    return true;
+}
+
+/* Copy a string into the arena and return its offset, or UINT32_MAX */
+static uint32_t title_index_intern(TitleIndex *index, const char *str) {
+    size_t len = strlen(str) + 1;
+    if (index->arena_len + len > index->arena_cap) {
+        size_t new_cap = index->arena_cap ? index->arena_cap * 2 : 64 * 1024;
+        while (new_cap < index->arena_len + len) {
+            new_cap *= 2;
+        }
+        char *grown = new_cap <= UINT32_MAX ? realloc(index->arena, new_cap) : NULL;
+        if (!grown) {
+            LOG_ERROR("Failed to grow title index");
+            return UINT32_MAX;
+        }
+        index->arena = grown;
+        index->arena_cap = new_cap;
+    }
+    uint32_t offset = index->arena_len;
+    memcpy(index->arena + offset, str, len);
+    index->arena_len += len;
+    return offset;
+}
+
+/* Find the bucket holding name, or the empty bucket where it belongs */
+static uint32_t* title_index_bucket(TitleIndex *index, const char *name) {
+    uint32_t mask = index->bucket_count - 1;
+    uint32_t slot = title_name_hash(name) & mask;
+    while (index->buckets[slot] != 0 &&
+           strcmp(title_index_str(index, index->entries[index->buckets[slot] - 1].name), name) != 0) {
+        slot = (slot + 1) & mask;
+    }
+    return &index->buckets[slot];
+}
+
+/* Keep the hash at most half full */
+static bool title_index_reserve_buckets(TitleIndex *index) {
+    if ((index->count + 1) * 2 <= index->bucket_count) {
+        return true;
+    }
+    uint32_t new_count = index->bucket_count ? index->bucket_count * 2 : 1024;
+    uint32_t *buckets = calloc(new_count, sizeof(uint32_t));
+    if (!buckets) {
+        LOG_ERROR("Failed to grow title index");
+        return false;
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucket_count = new_count;
+    for (uint32_t i = 0; i < index->count; i++) {
+        *title_index_bucket(index, title_index_str(index, index->entries[i].name)) = i + 1;
+    }
+    return true;
+}
+
+void title_index_reset(TitleIndex *index) {
+    index->arena_len = 0;
+    index->dir_count = 0;
+    index->count = 0;
+    index->generation++;
+    index->list_len = 0;
+    if (index->buckets) {
+        memset(index->buckets, 0, index->bucket_count * sizeof(uint32_t));
+    }
+}
+
+void title_index_free(TitleIndex *index) {
+    free(index->list_payload);
+    free(index->arena);
+    free(index->dirs);
+    free(index->entries);
+    free(index->buckets);
+    memset(index, 0, sizeof(*index));
+}
+
+/* Add a directory below parent (UINT32_MAX for the root); returns its id */
+static uint32_t title_index_add_dir(TitleIndex *index, uint32_t parent, const char *name) {
+    if (!grow_array((void**)&index->dirs, &index->dir_cap, index->dir_count, sizeof(TitleDir))) {
+        return UINT32_MAX;
+    }
+    uint32_t name_off = title_index_intern(index, name);
+    if (name_off == UINT32_MAX) {
+        return UINT32_MAX;
+    }
+    index->dirs[index->dir_count].parent = parent;
+    index->dirs[index->dir_count].name = name_off;
+    index->generation++;
+    return index->dir_count++;
+}
+
+/* Write the full path of dir, plus name when given, into buf */
+static bool title_index_build_path(TitleIndex *index, uint32_t dir, const char *name,
+                                   char *buf, size_t buf_size) {
+    size_t len = name ? strlen(name) : 0;
+    size_t pos = buf_size - 1;
+    if (len > pos) {
+        return false;
+    }
+    buf[pos] = '\0';
+    pos -= len;
+    memcpy(buf + pos, name, len);
+
+    for (uint32_t d = dir; d != UINT32_MAX; d = index->dirs[d].parent) {
+        const char *part = title_index_str(index, index->dirs[d].name);
+        size_t part_len = strlen(part);
+        bool separator = d != dir || name;
+        if (part_len + separator > pos) {
+            return false;
+        }
+        if (separator) {
+            buf[--pos] = '/';
+        }
+        pos -= part_len;
+        memcpy(buf + pos, part, part_len);
+    }
+    memmove(buf, buf + pos, buf_size - pos);
+    return true;
+}
+
+/* Add a title, refusing names already taken by another directory */
+static void title_index_add(TitleIndex *index, uint32_t dir, const char *name) {
+    if (!title_index_reserve_buckets(index) ||
+        !grow_array((void**)&index->entries, &index->cap, index->count, sizeof(TitleEntry))) {
+        return;
+    }
+
+    uint32_t *bucket = title_index_bucket(index, name);
+    if (*bucket != 0) {
+        char existing[MAX_PATH_LEN];
+        char duplicate[MAX_PATH_LEN];
+        TitleEntry *other = &index->entries[*bucket - 1];
+        title_index_build_path(index, other->dir, name, existing, sizeof(existing));
+        title_index_build_path(index, dir, name, duplicate, sizeof(duplicate));
+        LOG_WARNING("Duplicate title name %s, ignoring %s (already served from %s)",
+                    name, duplicate, existing);
+        return;
+    }
+
+    uint32_t name_off = title_index_intern(index, name);
+    if (name_off == UINT32_MAX) {
+        return;
+    }
+    index->entries[index->count].dir = dir;
+    index->entries[index->count].name = name_off;
+    index->count++;
+    *bucket = index->count;
+    index->generation++;
+    index->list_len += strlen(name) + 1;
+}
+
+/* Whether the cached payload was built from the index as it is now */
+static bool title_index_list_current(TitleIndex *index) {
+    return index->list_payload && index->list_payload_generation == index->generation;
+}
+
+/* Return the newline-separated title list, rebuilding it only when the
+ * index changed since it was last built; list_changed tells whether the
+ * rebuilt list differs from the previous one */
+static const char* title_index_list(TitleIndex *index, size_t *len) {
+    if (title_index_list_current(index)) {
+        *len = index->list_payload_len;
+        return index->list_payload;
+    }
+
+    char *payload = malloc(index->list_len + 1);
+    if (!payload) {
+        LOG_ERROR("Failed to allocate memory for title list");
+        return NULL;
+    }
+    char *out = payload;
+    for (uint32_t i = 0; i < index->count; i++) {
+        const char *name = title_index_str(index, index->entries[i].name);
+        /* Split titles and, when decompressing, compressed titles go by
+         * the name they are served under, unless another title has it */
+        char served[MAX_PATH_LEN];
+        bool renamed = split_title_name(name, true, served, sizeof(served));
+#ifdef HAVE_ZSTD
+        renamed = renamed || (use_decompress && swap_title_extension(name, false, served, sizeof(served)));
+#endif
+        if (renamed && *title_index_bucket(index, served) == 0) {
+            name = served;
+        }
+        size_t name_len = strlen(name);
+        memcpy(out, name, name_len);
+        out += name_len;
+        *out++ = '\n';
+    }
+    *out = '\0';
+
+    index->list_changed = !index->list_payload || index->list_payload_len != index->list_len ||
+                          memcmp(index->list_payload, payload, index->list_len) != 0;
+    free(index->list_payload);
+    index->list_payload = payload;
+    index->list_payload_len = index->list_len;
+    index->list_payload_generation = index->generation;
+    LOG_DEBUG("Rebuilt title list: %u titles, %zu bytes", index->count, index->list_len);
+    *len = index->list_len;
+    return payload;
+}
+
+/* On-disk copy of the scanned tree, loaded with mmap at startup so that
+ * directories whose mtime is unchanged need not be read again. Directories
+ * follow their parents; each lists its items sorted by name, and an item
+ * that is a subdirectory refers to it by index (UINT32_MAX for a title). */
+#define INDEX_FILE_MAGIC 0x58494244 /* "DBIX" */
+#define INDEX_FILE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t root;
+    uint32_t dir_count;
+    uint32_t item_count;
+    uint32_t reserved;
+    uint64_t strings_len;
+} IndexFileHeader;
+
+typedef struct {
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t first_item;
+    uint32_t item_count;
+} IndexFileDir;
+
+typedef struct {
+    uint32_t name;
+    uint32_t dir;
+} IndexFileItem;
+
+typedef struct {
+    void *data;
+    size_t size;
+    const IndexFileDir *dirs;
+    const IndexFileItem *items;
+    const char *strings;
+} IndexFile;
+
+/* Parallel directory scanner. Workers take directories from their own
+ * deque and steal from the others when it runs dry; every directory's
+ * entries are sorted by name and merged into the index depth-first once
+ * the walk is done, so the listing does not depend on thread timing. */
+typedef struct ScanNode ScanNode;
+
+typedef struct {
+    char *name;
+    ScanNode *dir;
+} ScanItem;
+
+struct ScanNode {
+    char *path;
+    const char *name;
+    ScanNode *parent;
+    int fd;
+    int wd;
+    int children_left;
+    uint32_t cached;
+    struct timespec mtime;
+    ScanItem *items;
+    uint32_t count;
+    uint32_t cap;
+};
+
+typedef enum {
+    SCAN_ENTRY_SKIP,
+    SCAN_ENTRY_DIR,
+    SCAN_ENTRY_TITLE
+} ScanEntryType;
+
+typedef struct {
+    ScanNode **nodes;
+    int head;
+    int tail;
+    int cap;
+    pthread_mutex_t lock;
+} ScanDeque;
+
+typedef struct {
+    ScanDeque *deques;
+    int workers;
+    int queued;
+    int pending;
+    int watch_fd;
+    bool unwatched;
+    const IndexFile *cache;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} DirScanner;
+
+typedef struct {
+    DirScanner *scanner;
+    int id;
+} ScanWorker;
+
+/* New scan node for path; its own name starts at name_off within path */
+static ScanNode* scan_node_new(const char *path, ScanNode *parent, size_t name_off) {
+    ScanNode *node = calloc(1, sizeof(ScanNode));
+    if (node) {
+        node->path = strdup(path);
+        if (!node->path) {
+            free(node);
+            return NULL;
+        }
+        node->name = node->path + name_off;
+        node->parent = parent;
+        node->fd = -1;
+        node->wd = -1;
+        node->cached = UINT32_MAX;
+    }
+    return node;
+}
+
+static void scan_node_free(ScanNode *node) {
+    for (uint32_t i = 0; i < node->count; i++) {
+        free(node->items[i].name);
+        if (node->items[i].dir) {
+            scan_node_free(node->items[i].dir);
+        }
+    }
+    free(node->items);
+    free(node->path);
+    free(node);
+}
+
+static bool scan_node_add(ScanNode *node, const char *name, ScanNode *dir) {
+    if (!grow_array((void**)&node->items, &node->cap, node->count, sizeof(ScanItem))) {
+        return false;
+    }
+    node->items[node->count].name = strdup(name);
+    node->items[node->count].dir = dir;
+    if (!node->items[node->count].name) {
+        return false;
+    }
+    node->count++;
+    return true;
+}
+
+static int scan_item_compare(const void *a, const void *b) {
+    return strcmp(((const ScanItem*)a)->name, ((const ScanItem*)b)->name);
+}
+
+/* Queue a directory on our deque. It is counted before it becomes visible,
+ * so a worker stealing it at once cannot take the counts below zero.
+ * Returns false when the deque cannot grow; the caller reads it instead. */
+static bool scan_deque_push(DirScanner *scanner, int id, ScanNode *node) {
+    ScanDeque *deque = &scanner->deques[id];
+    pthread_mutex_lock(&scanner->lock);
+    scanner->queued++;
+    scanner->pending++;
+    pthread_mutex_unlock(&scanner->lock);
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->cap) {
+        int new_cap = deque->cap ? deque->cap * 2 : 64;
+        ScanNode **nodes = realloc(deque->nodes, new_cap * sizeof(ScanNode*));
+        if (!nodes) {
+            pthread_mutex_unlock(&deque->lock);
+            LOG_WARNING("Failed to queue directory, reading it inline: %s", node->path);
+            pthread_mutex_lock(&scanner->lock);
+            scanner->queued--;
+            if (--scanner->pending == 0) {
+                pthread_cond_broadcast(&scanner->cond);
+            }
+            pthread_mutex_unlock(&scanner->lock);
+            return false;
+        }
+        deque->nodes = nodes;
+        deque->cap = new_cap;
+    }
+    deque->nodes[deque->tail++] = node;
+    pthread_mutex_unlock(&deque->lock);
+
+    pthread_mutex_lock(&scanner->lock);
+    pthread_cond_signal(&scanner->cond);
+    pthread_mutex_unlock(&scanner->lock);
+    return true;
+}
+
+/* Pop the newest directory of our own deque, or steal the oldest of another */
+static ScanNode* scan_deque_take(DirScanner *scanner, int id) {
+    for (int i = 0; i < scanner->workers; i++) {
+        ScanDeque *deque = &scanner->deques[(id + i) % scanner->workers];
+        ScanNode *node = NULL;
+        pthread_mutex_lock(&deque->lock);
+        if (deque->head < deque->tail) {
+            node = i == 0 ? deque->nodes[--deque->tail] : deque->nodes[deque->head++];
+            if (deque->head == deque->tail) {
+                deque->head = deque->tail = 0;
+            }
+        }
+        pthread_mutex_unlock(&deque->lock);
+        if (node) {
+            pthread_mutex_lock(&scanner->lock);
+            scanner->queued--;
+            pthread_mutex_unlock(&scanner->lock);
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/* Open the directory of node, relative to its parent's descriptor when the
+ * parent is still open, and let the parent close once all children are in */
+static int scan_node_open(DirScanner *scanner, ScanNode *node) {
+    int fd;
+#ifndef _WIN32
+    if (node->parent && node->parent->fd >= 0) {
+        fd = openat(node->parent->fd, node->name, O_RDONLY | O_DIRECTORY);
+    } else {
+        fd = open(node->path, O_RDONLY | O_DIRECTORY);
+    }
+#else
+    fd = 0;
+#endif
+
+    if (node->parent) {
+        pthread_mutex_lock(&scanner->lock);
+        if (--node->parent->children_left == 0) {
+#ifndef _WIN32
+            close(node->parent->fd);
+#endif
+            node->parent->fd = -1;
+        }
+        pthread_mutex_unlock(&scanner->lock);
+    }
+    return fd;
+}
+
+/* A directory named like a title that holds a part 00 is a split title,
+ * the way FAT32 transfer drives store large dumps */
+static bool scan_split_dir(int dir_fd, const char *dir_path, const char *name) {
+    char part[MAX_PATH_LEN];
+    struct stat st;
+#ifndef _WIN32
+    (void)dir_path;
+    snprintf(part, sizeof(part), "%s/00", name);
+    return fstatat(dir_fd, part, &st, 0) == 0 && S_ISREG(st.st_mode);
+#else
+    (void)dir_fd;
+    snprintf(part, sizeof(part), "%s/%s/00", dir_path, name);
+    return stat(part, &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+/* Classify a directory entry, trusting d_type and only calling stat for
+ * entries whose type is unknown or behind a symlink */
+static ScanEntryType scan_entry_type(int dir_fd, const char *dir_path, struct dirent *entry) {
+    bool candidate = has_valid_extension(entry->d_name);
+#ifdef DT_UNKNOWN
+    if (entry->d_type == DT_DIR) {
+        return candidate && scan_split_dir(dir_fd, dir_path, entry->d_name) ?
+               SCAN_ENTRY_TITLE : SCAN_ENTRY_DIR;
+    }
+    if (entry->d_type == DT_REG) {
+        return candidate ? SCAN_ENTRY_TITLE : SCAN_ENTRY_SKIP;
+    }
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK) {
+        return SCAN_ENTRY_SKIP;
+    }
+#endif
+
+    struct stat st;
+#ifndef _WIN32
+    (void)dir_path;
+    if (fstatat(dir_fd, entry->d_name, &st, 0) != 0) {
+        return SCAN_ENTRY_SKIP;
+    }
+#else
+    (void)dir_fd;
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+    if (stat(path, &st) != 0) {
+        return SCAN_ENTRY_SKIP;
+    }
+#endif
+    if (S_ISDIR(st.st_mode)) {
+        return candidate && scan_split_dir(dir_fd, dir_path, entry->d_name) ?
+               SCAN_ENTRY_TITLE : SCAN_ENTRY_DIR;
+    }
+    return S_ISREG(st.st_mode) && candidate ? SCAN_ENTRY_TITLE : SCAN_ENTRY_SKIP;
+}
+
+/* Watch a directory for titles coming and going. The watch is added before
+ * the directory is read, so nothing created in between goes unnoticed. */
+static void scan_node_watch(DirScanner *scanner, ScanNode *node) {
+#ifdef __linux__
+    if (scanner->watch_fd < 0) {
+        return;
+    }
+    node->wd = inotify_add_watch(scanner->watch_fd, node->path, LIBRARY_WATCH_MASK);
+    if (node->wd < 0) {
+        pthread_mutex_lock(&scanner->lock);
+        if (!scanner->unwatched) {
+            LOG_WARNING("Failed to watch %s: %s", node->path, strerror(errno));
+        }
+        scanner->unwatched = true;
+        pthread_mutex_unlock(&scanner->lock);
+    }
+#else
+    (void)scanner;
+    (void)node;
+#endif
+}
+
+/* Look up a directory item of the index file by name; items are sorted */
+static uint32_t index_file_find(const IndexFile *cache, uint32_t dir, const char *name) {
+    const IndexFileDir *d = &cache->dirs[dir];
+    uint32_t lo = d->first_item;
+    uint32_t hi = d->first_item + d->item_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(cache->strings + cache->items[mid].name, name);
+        if (cmp == 0) {
+            return cache->items[mid].dir;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return UINT32_MAX;
+}
+
+/* Take the entries of a directory from the index file when its mtime shows
+ * it has not changed since the file was written */
+static bool scan_node_reuse(DirScanner *scanner, ScanNode *node) {
+    if (!scanner->cache || node->cached == UINT32_MAX) {
+        return false;
+    }
+    const IndexFileDir *d = &scanner->cache->dirs[node->cached];
+    if (d->mtime_sec == 0 || d->mtime_sec != node->mtime.tv_sec ||
+        d->mtime_nsec != node->mtime.tv_nsec) {
+        return false;
+    }
+
+    size_t path_len = strlen(node->path);
+    for (uint32_t i = d->first_item; i < d->first_item + d->item_count; i++) {
+        const IndexFileItem *item = &scanner->cache->items[i];
+        const char *name = scanner->cache->strings + item->name;
+        if (item->dir == UINT32_MAX) {
+            scan_node_add(node, name, NULL);
+            continue;
+        }
+        size_t name_len = strlen(name);
+        if (path_len + 1 + name_len >= MAX_PATH_LEN) {
+            continue;
+        }
+        char path[MAX_PATH_LEN];
+        memcpy(path, node->path, path_len);
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, name, name_len + 1);
+        ScanNode *child = scan_node_new(path, node, path_len + 1);
+        if (child) {
+            child->cached = item->dir;
+            if (!scan_node_add(node, name, child)) {
+                scan_node_free(child);
+            }
+        }
+    }
+    LOG_DEBUG("Unchanged: %s", node->path);
+    return true;
+}
+
+/* Read the entries of a directory from disk; consumes fd on failure */
+static bool scan_node_list(DirScanner *scanner, ScanNode *node, int fd) {
+    DIR *dir = NULL;
+#ifndef _WIN32
+    if (fd >= 0) {
+        /* fdopendir() owns the descriptor it is given; keep ours for openat() */
+        int dir_fd = dup(fd);
+        dir = dir_fd >= 0 ? fdopendir(dir_fd) : NULL;
+        if (!dir && dir_fd >= 0) {
+            close(dir_fd);
+        }
+    }
+#else
+    dir = opendir(node->path);
+#endif
+    if (!dir) {
+        LOG_ERROR("Failed to open directory: %s", node->path);
+#ifndef _WIN32
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+        return false;
+    }
+
+    size_t path_len = strlen(node->path);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        ScanEntryType type = scan_entry_type(fd, node->path, entry);
+        if (type == SCAN_ENTRY_DIR) {
+            size_t name_len = strlen(entry->d_name);
+            if (path_len + 1 + name_len >= MAX_PATH_LEN) {
+                LOG_WARNING("Path too long, skipping: %s/%s", node->path, entry->d_name);
+                continue;
+            }
+            char path[MAX_PATH_LEN];
+            memcpy(path, node->path, path_len);
+            path[path_len] = '/';
+            memcpy(path + path_len + 1, entry->d_name, name_len + 1);
+
+            LOG_DEBUG("Found directory: %s", path);
+            ScanNode *child = scan_node_new(path, node, path_len + 1);
+            if (child && scanner->cache && node->cached != UINT32_MAX) {
+                child->cached = index_file_find(scanner->cache, node->cached, entry->d_name);
+            }
+            if (child && !scan_node_add(node, entry->d_name, child)) {
+                scan_node_free(child);
+            }
+        } else if (type == SCAN_ENTRY_TITLE) {
+            LOG_DEBUG("\t%s", entry->d_name);
+            scan_node_add(node, entry->d_name, NULL);
+        }
+    }
+    closedir(dir);
+
+    qsort(node->items, node->count, sizeof(ScanItem), scan_item_compare);
+    return true;
+}
+
+/* Read one directory, queueing its subdirectories on our deque */
+static void scan_node_read(DirScanner *scanner, int id, ScanNode *node) {
+    scan_node_watch(scanner, node);
+    int fd = scan_node_open(scanner, node);
+
+    /* Taken before listing, so a change made meanwhile shows up next time */
+    struct stat st;
+#ifndef _WIN32
+    bool have_mtime = fd >= 0 && fstat(fd, &st) == 0;
+#else
+    bool have_mtime = stat(node->path, &st) == 0;
+#endif
+    if (have_mtime) {
+        node->mtime = STAT_MTIME(st);
+    }
+
+    if (!(have_mtime && scan_node_reuse(scanner, node)) && !scan_node_list(scanner, node, fd)) {
+        return;
+    }
+
+    int children = 0;
+    for (uint32_t i = 0; i < node->count; i++) {
+        children += node->items[i].dir != NULL;
+    }
+    /* Children open relative to fd, which stays open until the last one has */
+    node->children_left = children;
+    node->fd = children > 0 ? fd : -1;
+#ifndef _WIN32
+    if (children == 0 && fd >= 0) {
+        close(fd);
+    }
+#endif
+    for (uint32_t i = 0; i < node->count; i++) {
+        if (node->items[i].dir && !scan_deque_push(scanner, id, node->items[i].dir)) {
+            scan_node_read(scanner, id, node->items[i].dir);
+        }
+    }
+}
+
+static void* scan_worker(void *arg) {
+    ScanWorker *worker = arg;
+    DirScanner *scanner = worker->scanner;
+
+    while (true) {
+        ScanNode *node = scan_deque_take(scanner, worker->id);
+        if (!node) {
+            pthread_mutex_lock(&scanner->lock);
+            while (scanner->queued == 0 && scanner->pending > 0) {
+                pthread_cond_wait(&scanner->cond, &scanner->lock);
+            }
+            bool done = scanner->pending == 0;
+            pthread_mutex_unlock(&scanner->lock);
+            if (done) {
+                break;
+            }
+            continue;
+        }
+
+        scan_node_read(scanner, worker->id, node);
+
+        pthread_mutex_lock(&scanner->lock);
+        if (--scanner->pending == 0) {
+            pthread_cond_broadcast(&scanner->cond);
+        }
+        pthread_mutex_unlock(&scanner->lock);
+    }
+    return NULL;
+}
+
+/* Walk the tree below root with the given number of worker threads, adding
+ * a watch on watch_fd (-1 for none) to every directory and reusing the
+ * entries of unchanged directories from cache when given. Returns false
+ * when some directory could not be watched. */
+static bool dir_scanner_run(ScanNode *root, int workers, int watch_fd, const IndexFile *cache) {
+    DirScanner scanner = { .workers = workers, .watch_fd = watch_fd, .cache = cache };
+    scanner.deques = calloc(workers, sizeof(ScanDeque));
+    ScanWorker *ids = calloc(workers, sizeof(ScanWorker));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    if (!scanner.deques || !ids || !threads) {
+        LOG_ERROR("Failed to allocate directory scanner");
+        free(scanner.deques);
+        free(ids);
+        free(threads);
+        return false;
+    }
+    pthread_mutex_init(&scanner.lock, NULL);
+    pthread_cond_init(&scanner.cond, NULL);
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_init(&scanner.deques[i].lock, NULL);
+        ids[i].scanner = &scanner;
+        ids[i].id = i;
+    }
+
+    if (!scan_deque_push(&scanner, 0, root)) {
+        scan_node_read(&scanner, 0, root);
+    }
+
+    int started = 0;
+    for (int i = 1; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, scan_worker, &ids[i]) != 0) {
+            break;
+        }
+        started = i;
+    }
+    scan_worker(&ids[0]);
+    for (int i = 1; i <= started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pthread_mutex_destroy(&scanner.deques[i].lock);
+        free(scanner.deques[i].nodes);
+    }
+    pthread_mutex_destroy(&scanner.lock);
+    pthread_cond_destroy(&scanner.cond);
+    free(scanner.deques);
+    free(ids);
+    free(threads);
+    return !scanner.unwatched;
+}
+
+/* Add a scanned directory's titles and subdirectories to the index */
+static void scan_node_merge(TitleIndex *index, uint32_t dir_id, ScanNode *node) {
+    for (uint32_t i = 0; i < node->count; i++) {
+        ScanItem *item = &node->items[i];
+        if (!item->dir) {
+            title_index_add(index, dir_id, item->name);
+            continue;
+        }
+        uint32_t child = title_index_add_dir(index, dir_id, item->name);
+        if (child != UINT32_MAX) {
+            scan_node_merge(index, child, item->dir);
+        }
+    }
+}
+
+/* Find title in index by display name, writing its path into path_buf.
+ * Unknown names are returned unchanged. */
+const char* find_title_path(TitleIndex *index, const char *display_name, char *path_buf) {
+    if (index->bucket_count == 0) {
+        return display_name;
+    }
+    uint32_t *bucket = title_index_bucket(index, display_name);
+    if (*bucket != 0 &&
+        title_index_build_path(index, index->entries[*bucket - 1].dir, display_name,
+                               path_buf, MAX_PATH_LEN)) {
+        return path_buf;
+    }
+    return display_name;
+}
+
+static void index_file_close(IndexFile *file) {
+    if (file->data) {
+#ifndef _WIN32
+        munmap(file->data, file->size);
+#else
+        free(file->data);
+#endif
+    }
+    memset(file, 0, sizeof(*file));
+}
+
+/* Map the index file and check that it is intact and describes root.
+ * Returns false, leaving file empty, when it cannot be used. */
+static bool index_file_open(IndexFile *file, const char *path, const char *root) {
+    memset(file, 0, sizeof(*file));
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            LOG_WARNING("Failed to open index file %s: %s", path, strerror(errno));
+        }
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(IndexFileHeader)) {
+        close(fd);
+        LOG_WARNING("Ignoring index file %s: truncated", path);
+        return false;
+    }
+    file->size = st.st_size;
+#ifndef _WIN32
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file->data == MAP_FAILED) {
+        file->data = NULL;
+    }
+#else
+    file->data = malloc(file->size);
+    if (file->data && pread(fd, file->data, file->size, 0) != (ssize_t)file->size) {
+        free(file->data);
+        file->data = NULL;
+    }
+#endif
+    close(fd);
+    if (!file->data) {
+        LOG_WARNING("Failed to map index file %s", path);
+        return false;
+    }
+
+    const IndexFileHeader *header = file->data;
+    const char *problem = NULL;
+    uint64_t dirs_size = (uint64_t)header->dir_count * sizeof(IndexFileDir);
+    uint64_t items_size = (uint64_t)header->item_count * sizeof(IndexFileItem);
+    if (header->magic != INDEX_FILE_MAGIC) {
+        problem = "not an index file";
+    } else if (header->version != INDEX_FILE_VERSION) {
+        problem = "written by another version";
+    } else if (header->dir_count == 0 || header->strings_len == 0 ||
+               sizeof(IndexFileHeader) + dirs_size + items_size + header->strings_len != file->size) {
+        problem = "size mismatch";
+    }
+    if (!problem) {
+        file->dirs = (const IndexFileDir*)((const char*)file->data + sizeof(IndexFileHeader));
+        file->items = (const IndexFileItem*)(file->dirs + header->dir_count);
+        file->strings = (const char*)(file->items + header->item_count);
+        if (file->strings[header->strings_len - 1] != '\0' || header->root >= header->strings_len) {
+            problem = "bad string table";
+        } else if (strcmp(file->strings + header->root, root) != 0) {
+            problem = "made for another titles directory";
+        }
+    }
+    /* Subdirectories must come after their parent, which rules out cycles */
+    for (uint32_t d = 0; !problem && d < header->dir_count; d++) {
+        const IndexFileDir *dir = &file->dirs[d];
+        if ((uint64_t)dir->first_item + dir->item_count > header->item_count) {
+            problem = "bad directory";
+            break;
+        }
+        for (uint32_t i = dir->first_item; i < dir->first_item + dir->item_count; i++) {
+            const IndexFileItem *item = &file->items[i];
+            if (item->name >= header->strings_len ||
+                (item->dir != UINT32_MAX && (item->dir <= d || item->dir >= header->dir_count))) {
+                problem = "bad directory entry";
+                break;
+            }
+        }
+    }
+    if (problem) {
+        LOG_WARNING("Ignoring index file %s: %s", path, problem);
+        index_file_close(file);
+        return false;
+    }
+    LOG_INFO("Loaded index file %s: %u directories, %u entries", path,
+             header->dir_count, header->item_count);
+    return true;
+}
+
+/* Add the titles and subdirectories an index file holds for dir to the
+ * index, in the order scan_node_merge adds a scanned tree */
+static void index_file_merge(TitleIndex *index, uint32_t dir_id, const IndexFile *file, uint32_t dir) {
+    const IndexFileDir *d = &file->dirs[dir];
+    for (uint32_t i = d->first_item; i < d->first_item + d->item_count; i++) {
+        const IndexFileItem *item = &file->items[i];
+        const char *name = file->strings + item->name;
+        if (item->dir == UINT32_MAX) {
+            title_index_add(index, dir_id, name);
+            continue;
+        }
+        uint32_t child = title_index_add_dir(index, dir_id, name);
+        if (child != UINT32_MAX) {
+            index_file_merge(index, child, file, item->dir);
+        }
+    }
+}
+
+/* Index file contents being assembled in memory */
+typedef struct {
+    IndexFileDir *dirs;
+    uint32_t dir_count;
+    uint32_t dir_cap;
+    IndexFileItem *items;
+    uint32_t item_count;
+    uint32_t item_cap;
+    ScanNode **nodes;
+    uint32_t node_cap;
+    char *strings;
+    size_t strings_len;
+    size_t strings_cap;
+} IndexFileWriter;
+
+static uint32_t index_writer_str(IndexFileWriter *writer, const char *str) {
+    size_t len = strlen(str) + 1;
+    if (writer->strings_len + len > UINT32_MAX) {
+        return UINT32_MAX;
+    }
+    if (writer->strings_len + len > writer->strings_cap) {
+        size_t new_cap = writer->strings_cap ? writer->strings_cap * 2 : 64 * 1024;
+        while (new_cap < writer->strings_len + len) {
+            new_cap *= 2;
+        }
+        char *grown = realloc(writer->strings, new_cap);
+        if (!grown) {
+            return UINT32_MAX;
+        }
+        writer->strings = grown;
+        writer->strings_cap = new_cap;
+    }
+    memcpy(writer->strings + writer->strings_len, str, len);
+    writer->strings_len += len;
+    return writer->strings_len - len;
+}
+
+/* Lay the tree out breadth-first, so every directory follows its parent.
+ * Directories changed within the last second are stored without an mtime:
+ * a change in the same clock tick would not move it, so they get reread. */
+static bool index_writer_build(IndexFileWriter *writer, ScanNode *root) {
+    time_t now = time(NULL);
+    if (!grow_array((void**)&writer->nodes, &writer->node_cap, 0, sizeof(ScanNode*)) ||
+        !grow_array((void**)&writer->dirs, &writer->dir_cap, 0, sizeof(IndexFileDir))) {
+        return false;
+    }
+    writer->nodes[0] = root;
+    writer->dir_count = 1;
+
+    for (uint32_t d = 0; d < writer->dir_count; d++) {
+        ScanNode *node = writer->nodes[d];
+        IndexFileDir *dir = &writer->dirs[d];
+        bool settled = node->mtime.tv_sec != 0 && node->mtime.tv_sec + 1 < now;
+        dir->mtime_sec = settled ? node->mtime.tv_sec : 0;
+        dir->mtime_nsec = settled ? node->mtime.tv_nsec : 0;
+        dir->first_item = writer->item_count;
+        dir->item_count = node->count;
+
+        for (uint32_t i = 0; i < node->count; i++) {
+            if (!grow_array((void**)&writer->items, &writer->item_cap, writer->item_count,
+                            sizeof(IndexFileItem))) {
+                return false;
+            }
+            IndexFileItem *item = &writer->items[writer->item_count++];
+            item->name = index_writer_str(writer, node->items[i].name);
+            item->dir = UINT32_MAX;
+            if (item->name == UINT32_MAX) {
+                return false;
+            }
+            if (node->items[i].dir) {
+                if (!grow_array((void**)&writer->nodes, &writer->node_cap, writer->dir_count,
+                                sizeof(ScanNode*)) ||
+                    !grow_array((void**)&writer->dirs, &writer->dir_cap, writer->dir_count,
+                                sizeof(IndexFileDir))) {
+                    return false;
+                }
+                writer->nodes[writer->dir_count] = node->items[i].dir;
+                item->dir = writer->dir_count++;
+            }
+        }
+    }
+    return true;
+}
+
+/* Write the tree below root to path, replacing the old file atomically */
+static void index_file_save(const char *path, const char *root_path, ScanNode *root) {
+    IndexFileWriter writer = {0};
+    IndexFileHeader header = {
+        .magic = INDEX_FILE_MAGIC,
+        .version = INDEX_FILE_VERSION,
+    };
+    header.root = index_writer_str(&writer, root_path);
+    bool ok = header.root != UINT32_MAX && index_writer_build(&writer, root);
+    header.dir_count = writer.dir_count;
+    header.item_count = writer.item_count;
+    header.strings_len = writer.strings_len;
+
+    char tmp_path[MAX_PATH_LEN];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        ok = false;
+    }
+    FILE *f = ok ? fopen(tmp_path, "wb") : NULL;
+    if (f) {
+        ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(writer.dirs, sizeof(IndexFileDir), writer.dir_count, f) == writer.dir_count &&
+             fwrite(writer.items, sizeof(IndexFileItem), writer.item_count, f) == writer.item_count &&
+             fwrite(writer.strings, 1, writer.strings_len, f) == writer.strings_len;
+        ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+        remove(path);
+#endif
+        if (!ok || rename(tmp_path, path) != 0) {
+            remove(tmp_path);
+            ok = false;
+        }
+    }
+    if (ok) {
+        LOG_DEBUG("Saved index file %s: %u directories, %u entries", path,
+                  writer.dir_count, writer.item_count);
+    } else {
+        LOG_WARNING("Failed to save index file %s", path);
+    }
+
+    free(writer.dirs);
+    free(writer.items);
+    free(writer.nodes);
+    free(writer.strings);
+}
+
+/* Titles library: the scanned directory tree and the index built from it.
+ * On Linux every directory carries an inotify watch and a watcher thread
+ * patches the tree as titles come and go, so LIST only reads memory.
+ * Elsewhere, or once a directory could not be watched, LIST rescans.
+ * The first scan runs on a builder thread while we wait for the console;
+ * with an index file, its listing is served as soon as it is loaded and
+ * replaced once the scan has checked it against the disk. The tree
+ * belongs to the builder while building, then to the watcher thread while
+ * watching, and to the LIST path otherwise; the lock guards the index and
+ * the ready, building and watching flags. */
+typedef struct {
+    const char *root_path;
+    ScanNode *root;
+    TitleIndex index;
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;
+    bool ready;
+    bool building;
+    time_t built;
+    bool builder_started;
+    pthread_t builder;
+    bool watching;
+    bool unwatched;
+#ifdef __linux__
+    int inotify_fd;
+    int stop_pipe[2];
+    bool watcher_started;
+    pthread_t watcher;
+    ScanNode **watches;
+    uint32_t watch_cap;
+#endif
+} TitleLibrary;
+
+static TitleLibrary library = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Map the watches of a freshly scanned subtree back to their directories */
+static void library_watch_register(ScanNode *node) {
+#ifdef __linux__
+    if (node->wd >= 0) {
+        if ((uint32_t)node->wd >= library.watch_cap) {
+            uint32_t new_cap = library.watch_cap ? library.watch_cap : 64;
+            while (new_cap <= (uint32_t)node->wd) {
+                new_cap *= 2;
+            }
+            ScanNode **watches = realloc(library.watches, new_cap * sizeof(ScanNode*));
+            if (!watches) {
+                LOG_ERROR("Failed to track watch on %s", node->path);
+                library.unwatched = true;
+                return;
+            }
+            memset(watches + library.watch_cap, 0,
+                   (new_cap - library.watch_cap) * sizeof(ScanNode*));
+            library.watches = watches;
+            library.watch_cap = new_cap;
+        }
+        if (library.watches[node->wd] && library.watches[node->wd] != node) {
+            /* One inode reached twice, through a symlink; a watch cannot tell
+             * the two apart */
+            LOG_WARNING("Directory %s is also reachable as %s",
+                        node->path, library.watches[node->wd]->path);
+            library.unwatched = true;
+        } else {
+            library.watches[node->wd] = node;
+        }
+    }
+#endif
+    for (uint32_t i = 0; i < node->count; i++) {
+        if (node->items[i].dir) {
+            library_watch_register(node->items[i].dir);
+        }
+    }
+}
+
+/* Drop the watches of a subtree that is leaving the tree */
+static void library_watch_forget(ScanNode *node) {
+#ifdef __linux__
+    if (node->wd >= 0 && (uint32_t)node->wd < library.watch_cap &&
+        library.watches[node->wd] == node) {
+        library.watches[node->wd] = NULL;
+        inotify_rm_watch(library.inotify_fd, node->wd);
+    }
+#endif
+    for (uint32_t i = 0; i < node->count; i++) {
+        if (node->items[i].dir) {
+            library_watch_forget(node->items[i].dir);
+        }
+    }
+}
+
+/* Scan a directory subtree, watching it when the library is watched.
+ * The node is scanned detached and hooked under parent afterwards; cache,
+ * when given, is an index file whose root directory is path. */
+static ScanNode* library_scan_subtree(const char *path, ScanNode *parent, const IndexFile *cache) {
+    size_t name_off = 0;
+    if (parent) {
+        name_off = strlen(parent->path) + 1;
+    }
+    ScanNode *node = scan_node_new(path, NULL, name_off);
+    if (!node) {
+        LOG_ERROR("Failed to allocate directory scanner");
+        library.unwatched = true;
+        return NULL;
+    }
+    if (cache) {
+        node->cached = 0;
+    }
+    int watch_fd = -1;
+#ifdef __linux__
+    watch_fd = library.inotify_fd;
+#endif
+    if (!dir_scanner_run(node, scan_threads, watch_fd, cache)) {
+        library.unwatched = true;
+    }
+    node->parent = parent;
+    library_watch_register(node);
+    return node;
+}
+
+/* Rescan the whole titles directory into a new tree */
+static void library_scan(const IndexFile *cache) {
+    if (library.root) {
+        library_watch_forget(library.root);
+        scan_node_free(library.root);
+    }
+    library.unwatched = false;
+    library.root = library_scan_subtree(library.root_path, NULL, cache);
+}
+
+static void library_save(void) {
+    if (index_file_path && library.root) {
+        index_file_save(index_file_path, library.root_path, library.root);
+    }
+}
+
+/* Rebuild the index from the tree, carrying the cached LIST payload over so
+ * the next one can be told apart from it. Called with the library lock held. */
+static void library_rebuild_index(void) {
+    TitleIndex fresh = {0};
+    fresh.generation = library.index.generation;
+    title_index_reset(&fresh);
+    uint32_t root_id = title_index_add_dir(&fresh, UINT32_MAX, library.root_path);
+    if (root_id != UINT32_MAX && library.root) {
+        scan_node_merge(&fresh, root_id, library.root);
+    }
+
+    fresh.list_payload = library.index.list_payload;
+    fresh.list_payload_len = library.index.list_payload_len;
+    fresh.list_payload_generation = library.index.list_payload_generation;
+    library.index.list_payload = NULL;
+    title_index_free(&library.index);
+    library.index = fresh;
+}
+
+#ifdef __linux__
+/* First item of node not ordered before name */
+static uint32_t scan_node_lower_bound(ScanNode *node, const char *name) {
+    uint32_t lo = 0;
+    uint32_t hi = node->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (strcmp(node->items[mid].name, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void scan_node_remove(ScanNode *node, uint32_t pos) {
+    ScanNode *dir = node->items[pos].dir;
+    if (dir) {
+        library_watch_forget(dir);
+        scan_node_free(dir);
+    }
+    free(node->items[pos].name);
+    memmove(&node->items[pos], &node->items[pos + 1],
+            (node->count - pos - 1) * sizeof(ScanItem));
+    node->count--;
+}
+
+static void scan_node_insert(ScanNode *node, uint32_t pos, const char *name, ScanNode *dir) {
+    char *copy = strdup(name);
+    if (!copy || !grow_array((void**)&node->items, &node->cap, node->count, sizeof(ScanItem))) {
+        free(copy);
+        if (dir) {
+            library_watch_forget(dir);
+            scan_node_free(dir);
+        }
+        library.unwatched = true;
+        return;
+    }
+    memmove(&node->items[pos + 1], &node->items[pos],
+            (node->count - pos) * sizeof(ScanItem));
+    node->items[pos].name = copy;
+    node->items[pos].dir = dir;
+    node->count++;
+}
+
+/* Part 00 arrived in a directory named like a title. Copied split titles
+ * start out as empty directories and are indexed as plain ones, so list
+ * the directory as a title now. */
+static bool library_split_dir_found(ScanNode *node) {
+    ScanNode *parent = node->parent;
+    char name[MAX_PATH_LEN];
+    snprintf(name, sizeof(name), "%s", node->name);
+    uint32_t pos = scan_node_lower_bound(parent, name);
+    if (pos >= parent->count || parent->items[pos].dir != node) {
+        return false;
+    }
+    LOG_DEBUG("Added split title: %s", node->path);
+    parent->mtime.tv_sec = 0;
+    parent->mtime.tv_nsec = 0;
+    scan_node_remove(parent, pos);
+    scan_node_insert(parent, pos, name, NULL);
+    return true;
+}
+
+/* Apply one inotify event to the tree. Every event is handled by looking at
+ * what is on disk now, so replays and reordering settle on the right tree.
+ * Returns true when the listing may have changed. */
+static bool library_apply_event(const struct inotify_event *event) {
+    if (event->wd < 0 || (uint32_t)event->wd >= library.watch_cap) {
+        return false;
+    }
+    ScanNode *node = library.watches[event->wd];
+    if (!node) {
+        return false;
+    }
+    if (event->mask & IN_IGNORED) {
+        library.watches[event->wd] = NULL;
+        node->wd = -1;
+        if (node == library.root) {
+            LOG_WARNING("Titles directory is no longer watched: %s", node->path);
+            library.unwatched = true;
+        }
+        return false;
+    }
+    if (event->len == 0 ||
+        !(event->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+        return false;
+    }
+    /* Files are added once written or moved in, so a title still being
+     * copied is not listed; creation only matters for directories */
+    if ((event->mask & IN_CREATE) && !(event->mask & IN_ISDIR)) {
+        return false;
+    }
+
+    /* The directory moved on from the mtime it was read at */
+    node->mtime.tv_sec = 0;
+    node->mtime.tv_nsec = 0;
+
+    const char *name = event->name;
+    uint32_t pos = scan_node_lower_bound(node, name);
+    bool changed = false;
+    if (pos < node->count && strcmp(node->items[pos].name, name) == 0) {
+        LOG_DEBUG("Removed: %s/%s", node->path, name);
+        scan_node_remove(node, pos);
+        changed = true;
+    }
+    if (!(event->mask & (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO))) {
+        return changed;
+    }
+
+    char path[MAX_PATH_LEN];
+    if (snprintf(path, sizeof(path), "%s/%s", node->path, name) >= (int)sizeof(path)) {
+        LOG_WARNING("Path too long, skipping: %s/%s", node->path, name);
+        return changed;
+    }
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return changed;
+    }
+    char part[MAX_PATH_LEN];
+    struct stat part_st;
+    if (S_ISDIR(st.st_mode) && has_valid_extension(name) &&
+        snprintf(part, sizeof(part), "%s/00", path) < (int)sizeof(part) &&
+        stat(part, &part_st) == 0 && S_ISREG(part_st.st_mode)) {
+        LOG_DEBUG("Added split title: %s", path);
+        scan_node_insert(node, pos, name, NULL);
+        return true;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        LOG_DEBUG("Found directory: %s", path);
+        ScanNode *dir = library_scan_subtree(path, node, NULL);
+        if (!dir) {
+            return changed;
+        }
+        scan_node_insert(node, pos, name, dir);
+        return true;
+    }
+    if (S_ISREG(st.st_mode) && strcmp(name, "00") == 0 && node->parent &&
+        has_valid_extension(node->name)) {
+        return library_split_dir_found(node) || changed;
+    }
+    if (S_ISREG(st.st_mode) && has_valid_extension(name)) {
+        LOG_DEBUG("Added: %s", path);
+        scan_node_insert(node, pos, name, NULL);
+        return true;
+    }
+    return changed;
+}
+
+/* Watcher thread: apply inotify events in batches, rebuilding the index once
+ * per batch and rescanning everything when the event queue overflowed */
+static void* library_watcher(void *arg) {
+    (void)arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        struct pollfd fds[2] = {
+            { .fd = library.inotify_fd, .events = POLLIN },
+            { .fd = library.stop_pipe[0], .events = POLLIN },
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("Failed to wait for title changes: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+
+        bool changed = false;
+        bool overflow = false;
+        ssize_t n;
+        while ((n = read(library.inotify_fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + n; ) {
+                const struct inotify_event *event = (const struct inotify_event*)p;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflow = true;
+                } else if (!overflow) {
+                    changed |= library_apply_event(event);
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        if (overflow) {
+            LOG_WARNING("Title change queue overflowed, rescanning %s", library.root_path);
+            library_scan(NULL);
+            changed = true;
+        }
+        if (changed) {
+            library_save();
+        }
+
+        pthread_mutex_lock(&library.lock);
+        if (changed) {
+            library_rebuild_index();
+        }
+        if (library.unwatched) {
+            /* The tree is handed to LIST from here on; do not touch it again */
+            library.watching = false;
+            close(library.inotify_fd);
+            library.inotify_fd = -1;
+            free(library.watches);
+            library.watches = NULL;
+            library.watch_cap = 0;
+        }
+        bool watching = library.watching;
+        pthread_mutex_unlock(&library.lock);
+        if (!watching) {
+            LOG_WARNING("Lost track of title changes, rescanning on every LIST");
+            break;
+        }
+    }
+    return NULL;
+}
+#endif
+
+/* Index the titles an index file lists. Called with the library lock held. */
+static void library_load_index(const IndexFile *cache) {
+    title_index_reset(&library.index);
+    uint32_t root_id = title_index_add_dir(&library.index, UINT32_MAX, library.root_path);
+    if (root_id != UINT32_MAX) {
+        index_file_merge(&library.index, root_id, cache, 0);
+    }
+}
+
+/* Builder thread: scan the titles directory and, where possible, start
+ * watching it, then let waiting commands through. An index file lets them
+ * through from the start, listing what it held until the scan is in. */
+static void* library_build(void *arg) {
+    (void)arg;
+    const char *root_path = library.root_path;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#ifdef __linux__
+    library.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (library.inotify_fd < 0) {
+        LOG_WARNING("Failed to watch titles directory: %s", strerror(errno));
+    }
+#endif
+
+    IndexFile cache;
+    bool cached = index_file_path && index_file_open(&cache, index_file_path, root_path);
+    if (cached) {
+        pthread_mutex_lock(&library.lock);
+        library_load_index(&cache);
+        library.ready = true;
+        pthread_cond_broadcast(&library.ready_cond);
+        LOG_INFO("Listing %u titles from the index file while checking it", library.index.count);
+        pthread_mutex_unlock(&library.lock);
+    }
+    library_scan(cached ? &cache : NULL);
+    if (cached) {
+        index_file_close(&cache);
+    }
+    library_save();
+    pthread_mutex_lock(&library.lock);
+    library_rebuild_index();
+    pthread_mutex_unlock(&library.lock);
+
+    /* Once started, the watcher owns the tree and the inotify state */
+#ifdef __linux__
+    bool watching = false;
+    if (library.inotify_fd >= 0 && !library.unwatched && pipe(library.stop_pipe) == 0) {
+        library.watching = true;
+        if (pthread_create(&library.watcher, NULL, library_watcher, NULL) == 0) {
+            library.watcher_started = true;
+            watching = true;
+            LOG_INFO("Watching %s for title changes", root_path);
+        } else {
+            library.watching = false;
+            close(library.stop_pipe[0]);
+            close(library.stop_pipe[1]);
+        }
+    }
+    if (!watching) {
+        if (library.inotify_fd >= 0) {
+            close(library.inotify_fd);
+            library.inotify_fd = -1;
+        }
+        free(library.watches);
+        library.watches = NULL;
+        library.watch_cap = 0;
+    }
+#endif
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_lock(&library.lock);
+    library.ready = true;
+    library.building = false;
+    library.built = time(NULL);
+    pthread_cond_broadcast(&library.ready_cond);
+    LOG_INFO("Indexed %u titles in %.2fs", library.index.count,
+             (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    pthread_mutex_unlock(&library.lock);
+    return NULL;
+}
+
+/* Start indexing the titles directory in the background */
+void library_open(const char *root_path) {
+    library.root_path = root_path;
+    library.building = true;
+    if (pthread_create(&library.builder, NULL, library_build, NULL) == 0) {
+        library.builder_started = true;
+    } else {
+        library_build(NULL);
+    }
+}
+
+/* Wait for the first scan to finish; called with the library lock held */
+static void library_wait_ready(void) {
+    if (!library.ready) {
+        LOG_INFO("Waiting for title scan to finish");
+    }
+    while (!library.ready) {
+        pthread_cond_wait(&library.ready_cond, &library.lock);
+    }
+}
+
+void library_close(void) {
+    if (library.builder_started) {
+        pthread_join(library.builder, NULL);
+        library.builder_started = false;
+    }
+#ifdef __linux__
+    if (library.watcher_started) {
+        if (write(library.stop_pipe[1], "", 1) < 0) {
+            LOG_ERROR("Failed to stop title watcher: %s", strerror(errno));
+        }
+        pthread_join(library.watcher, NULL);
+        close(library.stop_pipe[0]);
+        close(library.stop_pipe[1]);
+        library.watcher_started = false;
+    }
+    if (library.inotify_fd >= 0) {
+        close(library.inotify_fd);
+        library.inotify_fd = -1;
+    }
+    free(library.watches);
+    library.watches = NULL;
+    library.watch_cap = 0;
+#endif
+    if (library.root) {
+        scan_node_free(library.root);
+        library.root = NULL;
+    }
+    title_index_free(&library.index);
+    library.watching = false;
+    library.ready = false;
+}
+
+/* Return a copy of the title list for the caller to free, rescanning first
+ * unless changes are being watched, the first scan is still running or
+ * has only just finished. The cached payload itself may be
+ * rebuilt by another session as soon as the lock is dropped. */
+static char* library_list(size_t *len) {
+    pthread_mutex_lock(&library.lock);
+    library_wait_ready();
+    bool rescanned = false;
+    if (library.building) {
+        /* Listed from the index file; the builder's scan is under way */
+    } else if (!library.watching && time(NULL) - library.built >= LIBRARY_FRESH_SECS) {
+        /* Nothing reports changes since the builder's scan; look again */
+        library_scan(NULL);
+        library_rebuild_index();
+        rescanned = true;
+    }
+    const char *payload = title_index_list(&library.index, len);
+    if (rescanned && payload && library.index.list_changed) {
+        library_save();
+    }
+    char *list = payload ? malloc(*len + 1) : NULL;
+    if (list) {
+        memcpy(list, payload, *len + 1);
+    } else if (payload) {
+        LOG_ERROR("Failed to allocate memory for title list");
+    }
+    pthread_mutex_unlock(&library.lock);
+    return list;
+}
+
+/* Resolve a display name to its path in path_buf, or return it unchanged.
+ * Names not in the index may be listed for a split or compressed title. */
+static const char* library_find_path(const char *display_name, char *path_buf) {
+    pthread_mutex_lock(&library.lock);
+    library_wait_ready();
+    const char *path = find_title_path(&library.index, display_name, path_buf);
+    char name[MAX_PATH_LEN];
+    if (path != path_buf && split_title_name(display_name, false, name, sizeof(name))) {
+        path = find_title_path(&library.index, name, path_buf);
+    }
+#ifdef HAVE_ZSTD
+    if (path != path_buf && use_decompress &&
+        swap_title_extension(display_name, true, name, sizeof(name))) {
+        path = find_title_path(&library.index, name, path_buf);
+    }
+#endif
+    pthread_mutex_unlock(&library.lock);
+    return path == path_buf ? path : display_name;
+}
+
+/* Copy the path of every title into an array the caller frees */
+static char** library_title_paths(uint32_t *count) {
+    pthread_mutex_lock(&library.lock);
+    library_wait_ready();
+    TitleIndex *index = &library.index;
+    char **paths = malloc((index->count ? index->count : 1) * sizeof(char*));
+    *count = 0;
+    for (uint32_t i = 0; paths && i < index->count; i++) {
+        char path_buf[MAX_PATH_LEN];
+        TitleEntry *entry = &index->entries[i];
+        if (title_index_build_path(index, entry->dir, title_index_str(index, entry->name),
+                                   path_buf, sizeof(path_buf))) {
+            char *path = strdup(path_buf);
+            if (path) {
+                paths[(*count)++] = path;
+            }
+        }
+    }
+    pthread_mutex_unlock(&library.lock);
+    return paths;
+}
+
+/* Process EXIT command */
+void process_exit_command(UsbContext *ctx) {
+    LOG_INFO("Exit");
+    uint8_t response[16];
+    memcpy(response, "DBI0", 4);
+    *(uint32_t*)(response + 4) = CMD_TYPE_RESPONSE;
     *(uint32_t*)(response + 8) = CMD_EXIT;
     *(uint32_t*)(response + 12) = 0;
     usb_write(ctx, response, 16, USB_TIMEOUT);
 }
 
-/* Process LIST command */
-void process_list_command(UsbContext *ctx, const char *work_dir, TitleCache *cache) {
-    LOG_INFO("Get list");
+/* Process LIST command */
+void process_list_command(UsbContext *ctx) {
+    LOG_INFO("Get list");
+
+    size_t payload_len;
+    char *nsp_list = library_list(&payload_len);
+    if (!nsp_list) {
+        return;
+    }
+    uint32_t list_len = payload_len;
+
+    uint8_t response[16];
+    memcpy(response, "DBI0", 4);
+    *(uint32_t*)(response + 4) = CMD_TYPE_RESPONSE;
+    *(uint32_t*)(response + 8) = CMD_LIST;
+    *(uint32_t*)(response + 12) = list_len;
+    usb_write(ctx, response, 16, USB_TIMEOUT);
+
+    uint8_t ack[16];
+    if (usb_read(ctx, ack, 16, USB_TIMEOUT) != 16) {
+        LOG_ERROR("List not acknowledged");
+        free(nsp_list);
+        return;
+    }
+    uint32_t cmd_type = *(uint32_t*)(ack + 4);
+    uint32_t cmd_id = *(uint32_t*)(ack + 8);
+    uint32_t data_size = *(uint32_t*)(ack + 12);
+    LOG_DEBUG("Cmd Type: %u, Command id: %u, Data size: %u", cmd_type, cmd_id, data_size);
+    LOG_DEBUG("Ack");
+
+    usb_write(ctx, (uint8_t*)nsp_list, list_len, USB_TIMEOUT);
+    free(nsp_list);
+}
+
+/* Read count bytes at offset, retrying short and interrupted reads.
+ * Returns the number of bytes read, which is short only at end of file. */
+static ssize_t pread_full(int fd, uint8_t *buf, size_t count, uint64_t offset) {
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = pread(fd, buf + done, count - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return done ? (ssize_t)done : -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Open file cache: descriptors stay open across FILE_RANGE requests and
+ * are revalidated against the path every few seconds */
+typedef struct {
+    char *path;
+    int fd;
+    bool direct;
+    bool drop_cache;
+    bool stale;
+    int refs;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    uint64_t size;
+    time_t validated;
+    uint64_t last_used;
+} FdCacheEntry;
+
+typedef struct {
+    FdCacheEntry *entries;
+    int capacity;
+    int count;
+    uint64_t tick;
+    pthread_mutex_t lock;
+} FdCache;
+
+static FdCache fd_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void fd_cache_entry_close(FdCacheEntry *entry) {
+    close(entry->fd);
+    free(entry->path);
+    *entry = fd_cache.entries[--fd_cache.count];
+}
+
+/* Open path, preferring O_DIRECT in direct mode */
+static int fd_cache_open_file(const char *path, bool direct, bool *drop_cache) {
+    *drop_cache = false;
+#ifdef __linux__
+    if (direct) {
+        int fd = open(path, O_RDONLY | O_DIRECT);
+        if (fd >= 0) {
+            return fd;
+        }
+        LOG_DEBUG("O_DIRECT open failed for %s (%s), dropping cache instead", path, strerror(errno));
+        *drop_cache = true;
+    }
+#else
+    (void)direct;
+#endif
+    return open(path, O_RDONLY | O_BINARY);
+}
+
+static bool fd_cache_matches(FdCacheEntry *entry, struct stat *st) {
+    return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+           entry->size == (uint64_t)st->st_size &&
+           entry->mtime.tv_sec == STAT_MTIME(*st).tv_sec &&
+           entry->mtime.tv_nsec == STAT_MTIME(*st).tv_nsec;
+}
+
+/* Return an open descriptor for path; release it with fd_cache_release() */
+int fd_cache_acquire(const char *path, bool direct, uint64_t *size, bool *drop_cache) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&fd_cache.lock);
+
+    for (int i = 0; i < fd_cache.count; i++) {
+        FdCacheEntry *entry = &fd_cache.entries[i];
+        if (entry->stale || entry->direct != direct || strcmp(entry->path, path) != 0) {
+            continue;
+        }
+        if (now - entry->validated >= FD_CACHE_REVALIDATE_SECS) {
+            struct stat st;
+            if (stat(path, &st) != 0 || !fd_cache_matches(entry, &st)) {
+                LOG_DEBUG("File changed, reopening: %s", path);
+                if (entry->refs > 0) {
+                    entry->stale = true;
+                } else {
+                    fd_cache_entry_close(entry);
+                }
+                break;
+            }
+            entry->validated = now;
+        }
+        entry->refs++;
+        entry->last_used = ++fd_cache.tick;
+        *size = entry->size;
+        *drop_cache = entry->drop_cache;
+        int fd = entry->fd;
+        pthread_mutex_unlock(&fd_cache.lock);
+        return fd;
+    }
+    pthread_mutex_unlock(&fd_cache.lock);
+
+    bool drop;
+    int fd = fd_cache_open_file(path, direct, &drop);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    *size = st.st_size;
+    *drop_cache = drop;
+    LOG_DEBUG("Opened %s", path);
+
+    pthread_mutex_lock(&fd_cache.lock);
+    if (fd_cache.count == fd_cache.capacity) {
+        /* Evict the least recently used descriptor nobody is reading from */
+        FdCacheEntry *victim = NULL;
+        for (int i = 0; i < fd_cache.count; i++) {
+            FdCacheEntry *entry = &fd_cache.entries[i];
+            if (entry->refs == 0 && (!victim || entry->last_used < victim->last_used)) {
+                victim = entry;
+            }
+        }
+        if (victim) {
+            fd_cache_entry_close(victim);
+        }
+    }
+    char *path_copy = fd_cache.count < fd_cache.capacity ? strdup(path) : NULL;
+    if (path_copy) {
+        FdCacheEntry *entry = &fd_cache.entries[fd_cache.count++];
+        memset(entry, 0, sizeof(*entry));
+        entry->path = path_copy;
+        entry->fd = fd;
+        entry->direct = direct;
+        entry->drop_cache = drop;
+        entry->refs = 1;
+        entry->dev = st.st_dev;
+        entry->ino = st.st_ino;
+        entry->mtime = STAT_MTIME(st);
+        entry->size = st.st_size;
+        entry->validated = now;
+        entry->last_used = ++fd_cache.tick;
+    }
+    pthread_mutex_unlock(&fd_cache.lock);
+    /* Descriptors that did not fit in the cache are closed on release */
+    return fd;
+}
+
+void fd_cache_release(int fd) {
+    pthread_mutex_lock(&fd_cache.lock);
+    for (int i = 0; i < fd_cache.count; i++) {
+        FdCacheEntry *entry = &fd_cache.entries[i];
+        if (entry->fd == fd) {
+            entry->refs--;
+            if (entry->stale && entry->refs == 0) {
+                fd_cache_entry_close(entry);
+            }
+            pthread_mutex_unlock(&fd_cache.lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&fd_cache.lock);
+    close(fd);
+}
+
+int fd_cache_init(int capacity) {
+    fd_cache.capacity = capacity;
+    fd_cache.count = 0;
+    if (capacity == 0) {
+        return 0;
+    }
+    fd_cache.entries = calloc(capacity, sizeof(FdCacheEntry));
+    if (!fd_cache.entries) {
+        LOG_ERROR("Failed to allocate file handle cache");
+        fd_cache.capacity = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void fd_cache_free(void) {
+    pthread_mutex_lock(&fd_cache.lock);
+    while (fd_cache.count > 0) {
+        fd_cache_entry_close(&fd_cache.entries[0]);
+    }
+    free(fd_cache.entries);
+    fd_cache.entries = NULL;
+    fd_cache.capacity = 0;
+    pthread_mutex_unlock(&fd_cache.lock);
+}
+
+/* Split titles are read part by part, each through its own cached
+ * descriptor: part n of a split directory is the file named n in two
+ * digits, part n of a .ns0/.xc0 title the file ending in n instead of 0 */
+static bool split_part_path(const char *path, bool dir, uint32_t part, char *buf) {
+    int n = dir ? snprintf(buf, MAX_PATH_LEN, "%s/%02u", path, part) :
+                  snprintf(buf, MAX_PATH_LEN, "%.*s%u", (int)strlen(path) - 1, path, part);
+    return n > 0 && n < MAX_PATH_LEN;
+}
+
+/* Parts of the title at path and their sizes; count is 0 for an
+ * ordinary title */
+typedef struct {
+    char path[MAX_PATH_LEN];
+    bool dir;
+    uint32_t count;
+    uint64_t size;
+    uint64_t sizes[SPLIT_MAX_PARTS];
+} SplitTitle;
+
+/* Find the parts of the title at path; returns how many there are */
+static uint32_t split_title_scan(const char *path, SplitTitle *split) {
+    struct stat st;
+    size_t len = strlen(path);
+    bool numbered = len >= 4 && (strcasecmp(path + len - 4, ".ns0") == 0 ||
+                                 strcasecmp(path + len - 4, ".xc0") == 0);
+    snprintf(split->path, sizeof(split->path), "%s", path);
+    split->dir = !numbered && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    split->count = 0;
+    split->size = 0;
+    if (!numbered && !split->dir) {
+        return 0;
+    }
+    char part[MAX_PATH_LEN];
+    while (split->count < SPLIT_MAX_PARTS && split_part_path(path, split->dir, split->count, part) &&
+           stat(part, &st) == 0 && S_ISREG(st.st_mode)) {
+        split->sizes[split->count++] = st.st_size;
+        split->size += st.st_size;
+    }
+    return split->count;
+}
+
+/* Layouts of recently served titles, ordinary ones included, so a request
+ * does not stat the title and its parts again; like the fd cache they are
+ * revalidated every few seconds */
+typedef struct {
+    SplitTitle title;
+    time_t validated;
+    uint64_t last_used;
+} SplitCacheEntry;
+
+typedef struct {
+    SplitCacheEntry entries[SPLIT_CACHE_SIZE];
+    int count;
+    uint64_t tick;
+    pthread_mutex_t lock;
+} SplitCache;
+
+static SplitCache split_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static SplitCacheEntry* split_cache_find(const char *path) {
+    for (int i = 0; i < split_cache.count; i++) {
+        if (strcmp(split_cache.entries[i].title.path, path) == 0) {
+            return &split_cache.entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* Cached split_title_scan() */
+static uint32_t split_title_parts(const char *path, SplitTitle *split) {
+    time_t now = time(NULL);
+    pthread_mutex_lock(&split_cache.lock);
+    SplitCacheEntry *entry = split_cache_find(path);
+    if (entry && now - entry->validated < FD_CACHE_REVALIDATE_SECS) {
+        entry->last_used = ++split_cache.tick;
+        *split = entry->title;
+        pthread_mutex_unlock(&split_cache.lock);
+        return split->count;
+    }
+    pthread_mutex_unlock(&split_cache.lock);
+
+    split_title_scan(path, split);
+
+    pthread_mutex_lock(&split_cache.lock);
+    entry = split_cache_find(path);
+    if (!entry && split_cache.count < SPLIT_CACHE_SIZE) {
+        entry = &split_cache.entries[split_cache.count++];
+    }
+    if (!entry) {
+        /* Replace the least recently used layout */
+        entry = &split_cache.entries[0];
+        for (int i = 1; i < split_cache.count; i++) {
+            if (split_cache.entries[i].last_used < entry->last_used) {
+                entry = &split_cache.entries[i];
+            }
+        }
+    }
+    entry->title = *split;
+    entry->validated = now;
+    entry->last_used = ++split_cache.tick;
+    pthread_mutex_unlock(&split_cache.lock);
+    return split->count;
+}
+
+/* Source of file data for a streamed range: positional reads from a cached
+ * descriptor, in aligned windows for the cache-neutral direct mode. A split
+ * title's range is read across its parts, fd holding the current one. */
+typedef struct {
+    int fd;
+    bool direct;
+    bool drop_cache;
+    uint64_t offset;
+    uint64_t size;
+    const SplitTitle *split;
+    uint32_t part;
+} RangeSource;
+
+static int range_source_open(RangeSource *src, const char *path) {
+    uint64_t file_size;
+    src->direct = use_direct_io;
+    src->fd = fd_cache_acquire(path, src->direct, &file_size, &src->drop_cache);
+    return src->fd >= 0 ? 0 : -1;
+}
+
+#ifdef __linux__
+/* Read the aligned window holding relative position pos into buf. The
+ * payload starts at *skew and the window never exceeds one segment. */
+static int range_source_read_direct(RangeSource *src, uint64_t pos, uint8_t *buf, uint32_t *skew) {
+    uint64_t abs_pos = src->offset + pos;
+    uint64_t window = abs_pos & ~(uint64_t)(DIRECT_IO_ALIGN - 1);
+    uint64_t range_end = src->offset + src->size;
+    uint64_t want_end = window + BUFFER_SEGMENT_DATA_SIZE < range_end ?
+                        window + BUFFER_SEGMENT_DATA_SIZE : range_end;
+    size_t read_len = ((want_end + DIRECT_IO_ALIGN - 1) & ~(uint64_t)(DIRECT_IO_ALIGN - 1)) - window;
+
+    ssize_t done = pread_full(src->fd, buf, read_len, window);
+    if (done < 0 || (uint64_t)done < want_end - window) {
+        return -1;
+    }
+
+    if (src->drop_cache) {
+        posix_fadvise(src->fd, window, read_len, POSIX_FADV_DONTNEED);
+    }
+    *skew = abs_pos - window;
+    return want_end - abs_pos;
+}
+#endif
+
+static void range_source_close(RangeSource *src);
+
+/* Point src->fd at the given part of its split title */
+static int range_source_part(RangeSource *src, uint32_t part) {
+    if (src->fd >= 0 && src->part == part) {
+        return 0;
+    }
+    range_source_close(src);
+    src->fd = -1;
+    src->part = part;
+    char path[MAX_PATH_LEN];
+    uint64_t file_size;
+    if (!split_part_path(src->split->path, src->split->dir, part, path)) {
+        return -1;
+    }
+    src->fd = fd_cache_acquire(path, src->direct, &file_size, &src->drop_cache);
+    return src->fd >= 0 ? 0 : -1;
+}
+
+#ifdef __linux__
+/* Direct read of the next chunk of a split title: the window of an unsplit
+ * file, filled part by part. A part starting off the alignment can't be
+ * read in place, so the chunk stops short of it. */
+static int range_source_read_split_direct(RangeSource *src, uint64_t pos, uint8_t *buf, uint32_t *skew) {
+    const SplitTitle *split = src->split;
+    uint64_t abs_pos = src->offset + pos;
+    uint64_t window = abs_pos & ~(uint64_t)(DIRECT_IO_ALIGN - 1);
+    uint64_t range_end = src->offset + src->size;
+    uint64_t want_end = window + BUFFER_SEGMENT_DATA_SIZE < range_end ?
+                        window + BUFFER_SEGMENT_DATA_SIZE : range_end;
+
+    uint64_t start = 0;
+    uint32_t part = 0;
+    while (part < split->count && abs_pos >= start + split->sizes[part]) {
+        start += split->sizes[part++];
+    }
+    if (part == split->count || range_source_part(src, part) < 0) {
+        return -1;
+    }
+    if (start & (DIRECT_IO_ALIGN - 1)) {
+        uint64_t part_end = start + split->sizes[part];
+        RangeSource piece = { .fd = src->fd, .direct = true, .drop_cache = src->drop_cache,
+                              .offset = abs_pos - start,
+                              .size = (part_end < range_end ? part_end : range_end) - abs_pos };
+        return range_source_read_direct(&piece, 0, buf, skew);
+    }
+
+    uint64_t at = abs_pos;
+    while (at < want_end && !(start & (DIRECT_IO_ALIGN - 1))) {
+        if (range_source_part(src, part) < 0) {
+            return -1;
+        }
+        uint64_t end = start + split->sizes[part] < want_end ? start + split->sizes[part] : want_end;
+        uint64_t from = at & ~(uint64_t)(DIRECT_IO_ALIGN - 1);
+        size_t read_len = ((end + DIRECT_IO_ALIGN - 1) & ~(uint64_t)(DIRECT_IO_ALIGN - 1)) - from;
+        ssize_t done = pread_full(src->fd, buf + (from - window), read_len, from - start);
+        if (done < 0 || (uint64_t)done < end - from) {
+            return -1;
+        }
+        if (src->drop_cache) {
+            posix_fadvise(src->fd, from - start, read_len, POSIX_FADV_DONTNEED);
+        }
+        at = end;
+        start += split->sizes[part++];
+    }
+    *skew = abs_pos - window;
+    return at - abs_pos;
+}
+#endif
+
+/* Read the next chunk of a split title, running on across part boundaries
+ * so the reply is cut as for a single file */
+static int range_source_read_split(RangeSource *src, uint64_t pos, uint8_t *buf, uint32_t *skew) {
+    const SplitTitle *split = src->split;
+    uint64_t abs_pos = src->offset + pos;
+    uint32_t read_size = BUFFER_SEGMENT_DATA_SIZE;
+    if (pos + read_size >= src->size) {
+        read_size = src->size - pos;
+    }
+    *skew = 0;
+
+    uint64_t start = 0;
+    uint32_t part = 0;
+    uint32_t done = 0;
+    while (done < read_size) {
+        while (part < split->count && abs_pos + done >= start + split->sizes[part]) {
+            start += split->sizes[part++];
+        }
+        if (part == split->count || range_source_part(src, part) < 0) {
+            return -1;
+        }
+        uint64_t len = start + split->sizes[part] - (abs_pos + done);
+        if (len > read_size - done) {
+            len = read_size - done;
+        }
+        if (pread_full(src->fd, buf + done, len, abs_pos + done - start) != (ssize_t)len) {
+            return -1;
+        }
+        done += len;
+    }
+    return read_size;
+}
+
+/* Read the next chunk at relative position pos; returns the payload length */
+static int range_source_read(RangeSource *src, uint64_t pos, uint8_t *buf, uint32_t *skew) {
+    if (src->split) {
+#ifdef __linux__
+        if (src->direct) {
+            return range_source_read_split_direct(src, pos, buf, skew);
+        }
+#endif
+        return range_source_read_split(src, pos, buf, skew);
+    }
+#ifdef __linux__
+    if (src->direct) {
+        return range_source_read_direct(src, pos, buf, skew);
+    }
+#endif
+    uint32_t read_size = BUFFER_SEGMENT_DATA_SIZE;
+    if (pos + read_size >= src->size) {
+        read_size = src->size - pos;
+    }
+    *skew = 0;
+    return pread_full(src->fd, buf, read_size, src->offset + pos) == (ssize_t)read_size ?
+           (int)read_size : -1;
+}
+
+static void range_source_close(RangeSource *src) {
+    if (src->fd >= 0) {
+        fd_cache_release(src->fd);
+    }
+}
+
+/* Block cache: small FILE_RANGE reads, the container headers and metadata
+ * DBI goes back to several times per install, are served from fixed-size
+ * blocks kept in memory. Blocks are keyed by file identity, so a rewritten
+ * file misses, and spread over shards that each have their own lock, CLOCK
+ * hand and chained hash. Streaming ranges bypass it and cannot flush it. */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+} BlockFile;
+
+typedef struct {
+    BlockFile file;
+    uint64_t block;
+    uint32_t len;
+    uint32_t next;
+    bool used;
+    bool referenced;
+} BlockCacheSlot;
+
+/* Buckets and next links hold slot index + 1, zero ending a chain */
+typedef struct {
+    pthread_mutex_t lock;
+    BlockCacheSlot *slots;
+    uint8_t *data;
+    uint32_t *buckets;
+    uint32_t slot_count;
+    uint32_t hand;
+    uint64_t hits;
+    uint64_t misses;
+} BlockCacheShard;
+
+typedef struct {
+    BlockCacheShard *shards;
+    uint32_t shard_count;
+} BlockCache;
+
+static BlockCache block_cache;
+
+static void block_file_of(BlockFile *file, const struct stat *st) {
+    file->dev = st->st_dev;
+    file->ino = st->st_ino;
+    file->size = st->st_size;
+    file->mtime_ns = (uint64_t)STAT_MTIME(*st).tv_sec * 1000000000 + STAT_MTIME(*st).tv_nsec;
+}
+
+static uint64_t block_cache_hash(const BlockFile *file, uint64_t block) {
+    uint64_t h = (file->dev * 0x9E3779B97F4A7C15ULL) ^ file->ino;
+    h = (h ^ file->mtime_ns) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ block) * 0x94D049BB133111EBULL;
+    return h ^ (h >> 31);
+}
+
+/* Find a cached block; called with the shard lock held */
+static BlockCacheSlot* block_cache_find(BlockCacheShard *shard, uint32_t bucket,
+                                        const BlockFile *file, uint64_t block) {
+    for (uint32_t i = shard->buckets[bucket]; i; i = shard->slots[i - 1].next) {
+        BlockCacheSlot *slot = &shard->slots[i - 1];
+        if (slot->block == block && memcmp(&slot->file, file, sizeof(BlockFile)) == 0) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static BlockCacheShard* block_cache_shard(const BlockFile *file, uint64_t block, uint32_t *bucket) {
+    uint64_t h = block_cache_hash(file, block);
+    BlockCacheShard *shard = &block_cache.shards[h % block_cache.shard_count];
+    *bucket = (h >> 32) % shard->slot_count;
+    return shard;
+}
+
+/* Copy len bytes from offset from of a cached block into dest */
+static bool block_cache_get(const BlockFile *file, uint64_t block, uint32_t from,
+                            uint32_t len, uint8_t *dest) {
+    if (block_cache.shard_count == 0) {
+        return false;
+    }
+    uint32_t bucket;
+    BlockCacheShard *shard = block_cache_shard(file, block, &bucket);
+    pthread_mutex_lock(&shard->lock);
+    BlockCacheSlot *slot = block_cache_find(shard, bucket, file, block);
+    bool hit = slot && from + len <= slot->len;
+    if (hit) {
+        slot->referenced = true;
+        memcpy(dest, shard->data + (uint64_t)(slot - shard->slots) * BLOCK_CACHE_BLOCK_SIZE + from, len);
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return hit;
+}
+
+/* Unlink a slot from its hash chain; called with the shard lock held */
+static void block_cache_unlink(BlockCacheShard *shard, BlockCacheSlot *slot) {
+    uint32_t bucket = (block_cache_hash(&slot->file, slot->block) >> 32) % shard->slot_count;
+    uint32_t index = slot - shard->slots + 1;
+    uint32_t *link = &shard->buckets[bucket];
+    while (*link != index) {
+        link = &shard->slots[*link - 1].next;
+    }
+    *link = slot->next;
+    slot->used = false;
+}
+
+/* Store a block read from disk. New blocks start unreferenced, so blocks
+ * read only once are the first the CLOCK hand takes back. */
+static void block_cache_put(const BlockFile *file, uint64_t block, const uint8_t *data, uint32_t len) {
+    if (block_cache.shard_count == 0) {
+        return;
+    }
+    uint32_t bucket;
+    BlockCacheShard *shard = block_cache_shard(file, block, &bucket);
+    pthread_mutex_lock(&shard->lock);
+    if (block_cache_find(shard, bucket, file, block)) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    BlockCacheSlot *slot;
+    while (true) {
+        slot = &shard->slots[shard->hand];
+        shard->hand = (shard->hand + 1) % shard->slot_count;
+        if (!slot->used || !slot->referenced) {
+            break;
+        }
+        slot->referenced = false;
+    }
+    if (slot->used) {
+        block_cache_unlink(shard, slot);
+    }
+
+    slot->file = *file;
+    slot->block = block;
+    slot->len = len;
+    slot->used = true;
+    slot->referenced = false;
+    slot->next = shard->buckets[bucket];
+    shard->buckets[bucket] = slot - shard->slots + 1;
+    memcpy(shard->data + (uint64_t)(slot - shard->slots) * BLOCK_CACHE_BLOCK_SIZE, data, len);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void block_cache_free(void) {
+    uint64_t hits = 0, misses = 0;
+    for (uint32_t i = 0; i < block_cache.shard_count; i++) {
+        BlockCacheShard *shard = &block_cache.shards[i];
+        hits += shard->hits;
+        misses += shard->misses;
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->slots);
+        free(shard->buckets);
+        free(shard->data);
+    }
+    if (block_cache.shard_count > 0) {
+        LOG_DEBUG("Block cache: %lu hits, %lu misses", (unsigned long)hits, (unsigned long)misses);
+    }
+    free(block_cache.shards);
+    block_cache.shards = NULL;
+    block_cache.shard_count = 0;
+}
+
+/* Split a budget of bytes over the shards; memory is only touched as
+ * blocks are filled */
+int block_cache_init(uint64_t bytes) {
+    uint64_t blocks = bytes / BLOCK_CACHE_BLOCK_SIZE;
+    if (blocks == 0) {
+        return 0;
+    }
+    uint32_t shard_count = blocks < BLOCK_CACHE_SHARDS ? 1 : BLOCK_CACHE_SHARDS;
+    block_cache.shards = calloc(shard_count, sizeof(BlockCacheShard));
+    if (!block_cache.shards) {
+        LOG_ERROR("Failed to allocate block cache");
+        return -1;
+    }
+    block_cache.shard_count = shard_count;
+    for (uint32_t i = 0; i < shard_count; i++) {
+        BlockCacheShard *shard = &block_cache.shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->slot_count = blocks / shard_count;
+        shard->slots = calloc(shard->slot_count, sizeof(BlockCacheSlot));
+        shard->buckets = calloc(shard->slot_count, sizeof(uint32_t));
+        shard->data = malloc((uint64_t)shard->slot_count * BLOCK_CACHE_BLOCK_SIZE);
+        if (!shard->slots || !shard->buckets || !shard->data) {
+            LOG_ERROR("Failed to allocate block cache");
+            block_cache_free();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Read-ahead pipeline: a reader thread fills ring slots in order while the
+ * USB side submits them, so disk and USB latency overlap */
+typedef struct {
+    UsbTxRing *ring;
+    RangeSource *src;
+    int error;
+    bool stop;
+} ReadPipeline;
+
+static void* pipeline_reader(void *arg) {
+    ReadPipeline *p = arg;
+    UsbTxRing *ring = p->ring;
+    uint64_t curr_off = 0;
+
+    for (int seq = 0; curr_off < p->src->size; seq++) {
+        UsbTxSlot *slot = &ring->slots[seq % ring->size];
+
+        pthread_mutex_lock(&ring->lock);
+        while (!p->stop && (!slot->idle || slot->filled)) {
+            pthread_cond_wait(&ring->cond, &ring->lock);
+        }
+        bool stop = p->stop;
+        pthread_mutex_unlock(&ring->lock);
+        if (stop) {
+            break;
+        }
+
+        uint32_t skew;
+        int len = range_source_read(p->src, curr_off, slot->buffer, &skew);
+
+        pthread_mutex_lock(&ring->lock);
+        if (len < 0) {
+            LOG_ERROR("Failed to read from file");
+            p->error = -1;
+        } else {
+            slot->skew = skew;
+            slot->filled = len;
+        }
+        pthread_cond_broadcast(&ring->cond);
+        pthread_mutex_unlock(&ring->lock);
+        if (p->error) {
+            break;
+        }
+        curr_off += len;
+    }
+    return NULL;
+}
+
+/* Send the range, reading each chunk right before it is queued */
+static int stream_range_serial(UsbContext *ctx, RangeSource *src) {
+    uint64_t curr_off = 0;
+    int ret = 0;
+
+    while (curr_off < src->size) {
+        UsbTxSlot *slot = usb_tx_acquire(ctx);
+        if (!slot) {
+            ret = -1;
+            break;
+        }
+
+        uint32_t skew;
+        int len = range_source_read(src, curr_off, slot->buffer, &skew);
+        if (len < 0) {
+            LOG_ERROR("Failed to read from file");
+            ret = -1;
+            break;
+        }
+
+        if (usb_tx_submit(ctx, slot, slot->buffer + skew, len) < 0) {
+            ret = -1;
+            break;
+        }
+        curr_off += len;
+    }
+
+    if (usb_tx_flush(ctx) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Send the range with a reader thread running ahead of USB */
+static int stream_range_pipelined(UsbContext *ctx, RangeSource *src) {
+    UsbTxRing *ring = &ctx->tx;
+    ReadPipeline p = { .ring = ring, .src = src };
+    pthread_t reader;
+
+    if (pthread_create(&reader, NULL, pipeline_reader, &p) != 0) {
+        LOG_WARNING("Failed to start reader thread, reading inline");
+        return stream_range_serial(ctx, src);
+    }
+
+    uint64_t curr_off = 0;
+    int wait_seq = 0;
+    int ret = 0;
+
+    for (int seq = 0; curr_off < src->size; seq++) {
+        UsbTxSlot *slot = &ring->slots[seq % ring->size];
+
+        /* Keep at most depth transfers in flight */
+        while (wait_seq <= seq - ring->depth) {
+            if (usb_tx_wait_slot(ctx, &ring->slots[wait_seq % ring->size]) < 0) {
+                ret = -1;
+                break;
+            }
+            wait_seq++;
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        while (!slot->filled && !p.error && !ring->error && ret == 0) {
+            if (wait_seq < seq) {
+                /* Completions free slots for the reader; reap them instead of sleeping */
+                pthread_mutex_unlock(&ring->lock);
+                if (usb_tx_wait_slot(ctx, &ring->slots[wait_seq % ring->size]) < 0) {
+                    ret = -1;
+                }
+                wait_seq++;
+                pthread_mutex_lock(&ring->lock);
+            } else {
+                pthread_cond_wait(&ring->cond, &ring->lock);
+            }
+        }
+        uint32_t len = slot->filled;
+        if (p.error || ring->error) {
+            ret = -1;
+        }
+        pthread_mutex_unlock(&ring->lock);
+        if (ret < 0) {
+            break;
+        }
+
+        if (usb_tx_submit(ctx, slot, slot->buffer + slot->skew, len) < 0) {
+            ret = -1;
+            break;
+        }
+
+        pthread_mutex_lock(&ring->lock);
+        slot->filled = 0;
+        pthread_mutex_unlock(&ring->lock);
+        curr_off += len;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    p.stop = true;
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(reader, NULL);
+
+    for (int i = 0; i < ring->size; i++) {
+        ring->slots[i].filled = 0;
+    }
+    if (usb_tx_flush(ctx) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Send size bytes held in memory, in segment-sized transfers */
+static int stream_range_memory(UsbContext *ctx, const uint8_t *data, uint64_t size) {
+    uint64_t curr_off = 0;
+    uint32_t chunk = BUFFER_SEGMENT_DATA_SIZE;
+    int ret = 0;
+
+    while (curr_off < size) {
+        if (curr_off + chunk >= size) {
+            chunk = size - curr_off;
+        }
+
+        UsbTxSlot *slot = usb_tx_acquire(ctx);
+        if (!slot || usb_tx_submit(ctx, slot, (uint8_t*)data + curr_off, chunk) < 0) {
+            ret = -1;
+            break;
+        }
+        curr_off += chunk;
+    }
+
+    if (usb_tx_flush(ctx) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Copy size bytes at offset of an open file into dest through the block
+ * cache, reading each missing block whole so neighbouring reads hit it.
+ * Without a cache this is a plain read. */
+static int block_cache_read(int fd, bool direct, bool drop_cache, const struct stat *st,
+                            uint64_t offset, uint32_t size, uint8_t *dest) {
+    if (offset + size > (uint64_t)st->st_size) {
+        return -1;
+    }
+    BlockFile file;
+    block_file_of(&file, st);
+
+    uint8_t *block_buf = NULL;
+    int ret = 0;
+    for (uint64_t pos = offset; pos < offset + size; ) {
+        uint64_t block = pos / BLOCK_CACHE_BLOCK_SIZE;
+        uint32_t from = pos % BLOCK_CACHE_BLOCK_SIZE;
+        uint32_t len = BLOCK_CACHE_BLOCK_SIZE - from;
+        if (len > offset + size - pos) {
+            len = offset + size - pos;
+        }
+
+        if (!block_cache_get(&file, block, from, len, dest)) {
+            if (!block_buf) {
+#ifdef __linux__
+                void *aligned = NULL;
+                block_buf = posix_memalign(&aligned, DIRECT_IO_ALIGN, BLOCK_CACHE_BLOCK_SIZE) == 0 ?
+                            aligned : NULL;
+#else
+                block_buf = malloc(BLOCK_CACHE_BLOCK_SIZE);
+#endif
+            }
+            uint64_t start = block * BLOCK_CACHE_BLOCK_SIZE;
+            uint64_t block_len = st->st_size - start;
+            if (block_len > BLOCK_CACHE_BLOCK_SIZE) {
+                block_len = BLOCK_CACHE_BLOCK_SIZE;
+            }
+            /* O_DIRECT reads whole aligned blocks; the file end reads short */
+            size_t read_len = direct ? BLOCK_CACHE_BLOCK_SIZE : block_len;
+            if (!block_buf || pread_full(fd, block_buf, read_len, start) < (ssize_t)block_len) {
+                ret = -1;
+                break;
+            }
+#ifdef __linux__
+            if (drop_cache) {
+                posix_fadvise(fd, start, read_len, POSIX_FADV_DONTNEED);
+            }
+#else
+            (void)drop_cache;
+#endif
+            block_cache_put(&file, block, block_buf, block_len);
+            memcpy(dest, block_buf + from, len);
+        }
+        dest += len;
+        pos += len;
+    }
+    free(block_buf);
+    return ret;
+}
+
+/* Send a range of at most one segment through the block cache */
+static int stream_range_cached(UsbContext *ctx, const char *path, uint64_t offset, uint32_t size) {
+    RangeSource src = { .fd = -1, .offset = offset, .size = size };
+    struct stat st;
+    if (range_source_open(&src, path) < 0 || fstat(src.fd, &st) != 0) {
+        LOG_ERROR("Failed to open file: %s", path);
+        range_source_close(&src);
+        return -1;
+    }
+
+    UsbTxSlot *slot = usb_tx_acquire(ctx);
+    int ret = slot ? 0 : -1;
+    if (slot && block_cache_read(src.fd, src.direct, src.drop_cache, &st,
+                                 offset, size, slot->buffer) < 0) {
+        LOG_ERROR("Failed to read %u bytes at %lu from %s", size, (unsigned long)offset, path);
+        ret = -1;
+    }
+    range_source_close(&src);
+
+    if (ret == 0 && usb_tx_submit(ctx, slot, slot->buffer, size) < 0) {
+        ret = -1;
+    }
+    if (usb_tx_flush(ctx) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Header pre-warming: once the first scan is done, worker threads read
+ * the container header and partition tables of every title into the
+ * block cache, so the first FILE_RANGE replies for a title come from
+ * memory rather than a spun-down disk */
+typedef struct {
+    pthread_t thread;
+    bool started;
+    pthread_mutex_t lock;
+    char **paths;
+    uint32_t count;
+    uint32_t next;
+    bool stop;
+} Prewarm;
+
+static Prewarm prewarm = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+typedef struct {
+    int fd;
+    bool direct;
+    bool drop_cache;
+    struct stat st;
+} PrewarmFile;
+
+/* Size of the PFS0 or HFS0 header at buf, or 0 if there is none */
+static uint64_t partition_header_size(const uint8_t *buf) {
+    uint32_t count = *(const uint32_t*)(buf + 4);
+    uint32_t strings = *(const uint32_t*)(buf + 8);
+    if (memcmp(buf, "PFS0", 4) == 0) {
+        return 0x10 + (uint64_t)count * PFS0_ENTRY_SIZE + strings;
+    }
+    if (memcmp(buf, "HFS0", 4) == 0) {
+        return 0x10 + (uint64_t)count * HFS0_ENTRY_SIZE + strings;
+    }
+    return 0;
+}
+
+/* Cache the partition header at offset, leaving it in buf; returns its size */
+static uint64_t prewarm_partition(PrewarmFile *file, uint64_t offset, uint8_t *buf) {
+    if (block_cache_read(file->fd, file->direct, file->drop_cache, &file->st, offset, 0x10, buf) < 0) {
+        return 0;
+    }
+    uint64_t size = partition_header_size(buf);
+    if (size == 0 || size > BUFFER_SEGMENT_DATA_SIZE ||
+        block_cache_read(file->fd, file->direct, file->drop_cache, &file->st, offset, size, buf) < 0) {
+        return 0;
+    }
+    return size;
+}
+
+/* Open a title for header reads, bypassing the fd cache. The headers of
+ * a split title are in its first part. */
+static int prewarm_file_open(PrewarmFile *file, const char *path) {
+    SplitTitle split;
+    char part[MAX_PATH_LEN];
+    if (split_title_scan(path, &split) > 0 && split_part_path(path, split.dir, 0, part)) {
+        path = part;
+    }
+    file->fd = fd_cache_open_file(path, use_direct_io, &file->drop_cache);
+    if (file->fd < 0 || fstat(file->fd, &file->st) != 0) {
+        LOG_DEBUG("Cannot read headers of %s: %s", path, strerror(errno));
+        if (file->fd >= 0) {
+            close(file->fd);
+        }
+        return -1;
+    }
+    file->direct = use_direct_io && !file->drop_cache;
+    return 0;
+}
+
+/* Cache the PFS0 header of an NSP/NSZ, or the header, root HFS0 and
+ * partition HFS0 headers of an XCI/XCZ */
+static void prewarm_title(const char *path, uint8_t *buf) {
+    PrewarmFile file;
+    if (prewarm_file_open(&file, path) < 0) {
+        return;
+    }
+
+    if (prewarm_partition(&file, 0, buf) == 0 &&
+        block_cache_read(file.fd, file.direct, file.drop_cache, &file.st, 0, XCI_HEADER_SIZE, buf) == 0 &&
+        memcmp(buf + 0x100, "HEAD", 4) == 0) {
+        uint64_t root = *(uint64_t*)(buf + 0x130);
+        uint64_t root_size = prewarm_partition(&file, root, buf);
+        uint32_t count = root_size ? *(uint32_t*)(buf + 4) : 0;
+        if (count > XCI_MAX_PARTITIONS) {
+            count = XCI_MAX_PARTITIONS;
+        }
+        /* Partition data offsets are relative to the end of the root header */
+        uint64_t partitions[XCI_MAX_PARTITIONS];
+        for (uint32_t i = 0; i < count; i++) {
+            partitions[i] = root + root_size + *(uint64_t*)(buf + 0x10 + i * HFS0_ENTRY_SIZE);
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            prewarm_partition(&file, partitions[i], buf);
+        }
+    }
+    close(file.fd);
+}
+
+static void* prewarm_worker(void *arg) {
+    (void)arg;
+    uint8_t *buf = malloc(BUFFER_SEGMENT_DATA_SIZE);
+    if (!buf) {
+        LOG_ERROR("Failed to allocate pre-warm buffer");
+        return NULL;
+    }
+    while (true) {
+        pthread_mutex_lock(&prewarm.lock);
+        const char *path = !prewarm.stop && prewarm.next < prewarm.count ?
+                           prewarm.paths[prewarm.next++] : NULL;
+        pthread_mutex_unlock(&prewarm.lock);
+        if (!path) {
+            break;
+        }
+        prewarm_title(path, buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+/* Wait for the first scan, then spread the titles over scan_threads workers */
+static void* prewarm_run(void *arg) {
+    (void)arg;
+    uint32_t count;
+    char **paths = library_title_paths(&count);
+    if (!paths) {
+        return NULL;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&prewarm.lock);
+    prewarm.paths = paths;
+    prewarm.count = count;
+    pthread_mutex_unlock(&prewarm.lock);
+
+    pthread_t threads[MAX_SCAN_THREADS];
+    int started = 0;
+    while (started < scan_threads - 1 &&
+           pthread_create(&threads[started], NULL, prewarm_worker, NULL) == 0) {
+        started++;
+    }
+    prewarm_worker(NULL);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_mutex_lock(&prewarm.lock);
+    if (!prewarm.stop) {
+        LOG_INFO("Pre-warmed headers of %u titles in %.2fs", count,
+                 (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    }
+    pthread_mutex_unlock(&prewarm.lock);
+    return NULL;
+}
+
+void prewarm_start(void) {
+    if (block_cache.shard_count == 0) {
+        LOG_WARNING("--prewarm needs the block cache, not pre-warming");
+        return;
+    }
+    prewarm.started = pthread_create(&prewarm.thread, NULL, prewarm_run, NULL) == 0;
+    if (!prewarm.started) {
+        LOG_WARNING("Failed to start header pre-warming");
+    }
+}
+
+void prewarm_stop(void) {
+    if (!prewarm.started) {
+        return;
+    }
+    pthread_mutex_lock(&prewarm.lock);
+    prewarm.stop = true;
+    pthread_mutex_unlock(&prewarm.lock);
+    pthread_join(prewarm.thread, NULL);
+    prewarm.started = false;
+    for (uint32_t i = 0; i < prewarm.count; i++) {
+        free(prewarm.paths[i]);
+    }
+    free(prewarm.paths);
+    prewarm.paths = NULL;
+    prewarm.count = 0;
+}
+
+/* File stored in a PFS0 or HFS0 partition, at an absolute title offset.
+ * Metadata is what DBI reads before any content: tickets, certificates,
+ * the CNMT NCA and anything else small. */
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    bool meta;
+} ContainerEntry;
+
+static bool name_has_suffix(const char *name, size_t len, const char *suffix) {
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strncasecmp(name + len - suffix_len, suffix, suffix_len) == 0;
+}
+
+/* List the files of the partition header that prewarm_partition() left in
+ * buf, the partition starting at offset. Names are only valid until buf
+ * is reused, so the XCI secure partition is looked up here too. */
+static uint32_t container_entries(const uint8_t *buf, uint64_t offset, uint64_t header_size,
+                                  ContainerEntry *entries, uint32_t max, uint64_t *secure) {
+    bool hfs0 = memcmp(buf, "HFS0", 4) == 0;
+    uint32_t count = *(const uint32_t*)(buf + 4);
+    uint32_t strings_len = *(const uint32_t*)(buf + 8);
+    uint32_t entry_size = hfs0 ? HFS0_ENTRY_SIZE : PFS0_ENTRY_SIZE;
+    const char *strings = (const char*)buf + 0x10 + (uint64_t)count * entry_size;
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count && n < max; i++) {
+        const uint8_t *entry = buf + 0x10 + (uint64_t)i * entry_size;
+        uint32_t name_off = *(const uint32_t*)(entry + 16);
+        const char *name = name_off < strings_len ? strings + name_off : "";
+        size_t name_len = name_off < strings_len ? strnlen(name, strings_len - name_off) : 0;
+
+        ContainerEntry *e = &entries[n++];
+        e->offset = offset + header_size + *(const uint64_t*)entry;
+        e->size = *(const uint64_t*)(entry + 8);
+        e->meta = e->size <= BLOCK_CACHE_MAX_RANGE ||
+                  name_has_suffix(name, name_len, ".cnmt.nca") ||
+                  name_has_suffix(name, name_len, ".cnmt.ncz");
+        if (secure && hfs0 && name_len == 6 && memcmp(name, "secure", 6) == 0) {
+            *secure = e->offset;
+        }
+    }
+    return n;
+}
+
+/* Get a title ready the way DBI installs it: metadata entries go into the
+ * block cache first, then the NCA header of every content NCA, and the
+ * kernel is asked to start reading the head of each NCA so the disk is
+ * ahead of the console when it jumps from one to the next */
+static void prefetch_layout(const char *path, uint8_t *buf) {
+    PrewarmFile file;
+    if (prewarm_file_open(&file, path) < 0) {
+        return;
+    }
+
+    ContainerEntry entries[CONTAINER_MAX_ENTRIES];
+    uint32_t count = 0;
+    uint64_t header_size = prewarm_partition(&file, 0, buf);
+    if (header_size) {
+        count = container_entries(buf, 0, header_size, entries, CONTAINER_MAX_ENTRIES, NULL);
+    } else if (block_cache_read(file.fd, file.direct, file.drop_cache, &file.st, 0, XCI_HEADER_SIZE, buf) == 0 &&
+               memcmp(buf + 0x100, "HEAD", 4) == 0) {
+        uint64_t root = *(uint64_t*)(buf + 0x130);
+        uint64_t secure = 0;
+        header_size = prewarm_partition(&file, root, buf);
+        if (header_size) {
+            ContainerEntry partitions[XCI_MAX_PARTITIONS];
+            container_entries(buf, root, header_size, partitions, XCI_MAX_PARTITIONS, &secure);
+        }
+        header_size = secure ? prewarm_partition(&file, secure, buf) : 0;
+        if (header_size) {
+            count = container_entries(buf, secure, header_size, entries, CONTAINER_MAX_ENTRIES, NULL);
+        }
+    }
+
+    uint32_t meta = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < count; i++) {
+            ContainerEntry *entry = &entries[i];
+            if (entry->meta != (pass == 0) || entry->offset > (uint64_t)file.st.st_size) {
+                continue;
+            }
+            uint64_t head = entry->meta ? entry->size : NCA_HEADER_SIZE;
+            if (head > BUFFER_SEGMENT_DATA_SIZE) {
+                head = BUFFER_SEGMENT_DATA_SIZE;
+            }
+            if (head > file.st.st_size - entry->offset) {
+                head = file.st.st_size - entry->offset;
+            }
+            if (block_cache.shard_count > 0) {
+                block_cache_read(file.fd, file.direct, file.drop_cache, &file.st,
+                                 entry->offset, head, buf);
+            }
+#ifdef __linux__
+            /* O_DIRECT reads skip the page cache, so readahead would be wasted */
+            if (!use_direct_io) {
+                uint64_t ahead = entry->meta ? entry->size : PREFETCH_MAX_SIZE;
+                posix_fadvise(file.fd, entry->offset, ahead < entry->size ? ahead : entry->size,
+                              POSIX_FADV_WILLNEED);
+            }
+#endif
+            meta += entry->meta;
+        }
+    }
+    LOG_DEBUG("Scheduled %s: %u metadata entries, %u NCAs", path, meta, count - meta);
+    close(file.fd);
+}
+
+/* Speculative prefetch: once a file is read sequentially, the range that
+ * would follow the last request is read into memory while the console
+ * prepares its next FILE_RANGE. The first time a title is served, its
+ * container layout is read and scheduled as well. */
+typedef struct {
+    char path[MAX_PATH_LEN];
+    uint64_t next_offset;
+} SeqStream;
+
+/* One file's read-ahead range and its buffer. With --multi every console
+ * streaming a different title gets its own slot, so their read-aheads do
+ * not replace each other; buffers are allocated on first use. */
+typedef struct {
+    bool queued;
+    bool busy;
+    bool ready;
+    int users;
+    char path[MAX_PATH_LEN];
+    uint64_t offset;
+    uint64_t size;
+    uint64_t last_used;
+    uint8_t *buffer;
+    uint8_t *data;
+} PrefetchSlot;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool quit;
+    PrefetchSlot slots[MAX_CONSOLES];
+    int slot_count;
+    uint64_t clock;
+    SeqStream streams[PREFETCH_TRACKED_FILES];
+    int next_stream;
+    char layout_queue[PREFETCH_LAYOUT_JOBS][MAX_PATH_LEN];
+    int layout_head;
+    int layout_queued;
+    uint8_t *layout_buffer;
+    char layouts[PREFETCH_TRACKED_FILES][MAX_PATH_LEN];
+    int next_layout;
+    uint64_t hits;
+    uint64_t misses;
+} Prefetcher;
+
+static Prefetcher prefetcher;
+
+/* Read the queued range into the slot's buffer */
+static bool prefetch_read(PrefetchSlot *slot, const char *path, uint64_t offset, uint64_t size) {
+    RangeSource src = { .fd = -1, .offset = offset, .size = size };
+    if (range_source_open(&src, path) < 0) {
+        return false;
+    }
+
+    uint64_t pos = 0;
+    uint32_t first_skew = 0;
+    bool ok = true;
+    while (pos < size) {
+        uint32_t skew;
+        /* Windows after the first are aligned, so they land contiguously */
+        uint8_t *dest = pos == 0 ? slot->buffer : slot->buffer + first_skew + pos;
+        int len = range_source_read(&src, pos, dest, &skew);
+        if (len < 0) {
+            ok = false;
+            break;
+        }
+        if (pos == 0) {
+            first_skew = skew;
+        }
+        pos += len;
+    }
+    range_source_close(&src);
+
+    slot->data = slot->buffer + first_skew;
+    return ok;
+}
+
+/* A slot with a range queued and nobody reading its buffer */
+static PrefetchSlot* prefetch_next_queued(void) {
+    for (int i = 0; i < prefetcher.slot_count; i++) {
+        if (prefetcher.slots[i].queued && prefetcher.slots[i].users == 0) {
+            return &prefetcher.slots[i];
+        }
+    }
+    return NULL;
+}
+
+static void* prefetch_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&prefetcher.lock);
+    while (true) {
+        PrefetchSlot *slot;
+        while (!prefetcher.quit && !(slot = prefetch_next_queued()) && prefetcher.layout_queued == 0) {
+            pthread_cond_wait(&prefetcher.cond, &prefetcher.lock);
+        }
+        if (prefetcher.quit) {
+            break;
+        }
+        /* The ranges consoles are streaming come first */
+        if (!slot) {
+            char path[MAX_PATH_LEN];
+            strcpy(path, prefetcher.layout_queue[prefetcher.layout_head]);
+            prefetcher.layout_head = (prefetcher.layout_head + 1) % PREFETCH_LAYOUT_JOBS;
+            prefetcher.layout_queued--;
+            pthread_mutex_unlock(&prefetcher.lock);
+            prefetch_layout(path, prefetcher.layout_buffer);
+            pthread_mutex_lock(&prefetcher.lock);
+            continue;
+        }
+
+        char path[MAX_PATH_LEN];
+        strcpy(path, slot->path);
+        uint64_t offset = slot->offset;
+        uint64_t size = slot->size;
+        slot->queued = false;
+        slot->ready = false;
+        slot->busy = true;
+        pthread_mutex_unlock(&prefetcher.lock);
+
+        if (!slot->buffer) {
+#ifdef __linux__
+            void *buffer = NULL;
+            slot->buffer = posix_memalign(&buffer, DIRECT_IO_ALIGN,
+                                          PREFETCH_MAX_SIZE + 2 * DIRECT_IO_ALIGN) == 0 ? buffer : NULL;
+#else
+            slot->buffer = malloc(PREFETCH_MAX_SIZE + 2 * DIRECT_IO_ALIGN);
+#endif
+            if (!slot->buffer) {
+                LOG_ERROR("Failed to allocate prefetch buffer");
+            }
+        }
+        bool ok = slot->buffer && prefetch_read(slot, path, offset, size);
+
+        pthread_mutex_lock(&prefetcher.lock);
+        slot->busy = false;
+        /* A newer request may have replaced the one just read */
+        slot->ready = ok && !slot->queued;
+        pthread_cond_broadcast(&prefetcher.cond);
+        LOG_DEBUG("Prefetched %s [%lu, +%lu)%s", path, offset, size, ok ? "" : " failed");
+    }
+    pthread_mutex_unlock(&prefetcher.lock);
+    return NULL;
+}
+
+/* Start the prefetch thread with one read-ahead slot per console that may
+ * be streaming at once */
+int prefetch_start(int slots) {
+    memset(&prefetcher, 0, sizeof(prefetcher));
+    prefetcher.slot_count = slots < MAX_CONSOLES ? slots : MAX_CONSOLES;
+#ifdef __linux__
+    void *layout_buffer = NULL;
+    prefetcher.layout_buffer = posix_memalign(&layout_buffer, DIRECT_IO_ALIGN,
+                                              BUFFER_SEGMENT_DATA_SIZE) == 0 ? layout_buffer : NULL;
+#else
+    prefetcher.layout_buffer = malloc(BUFFER_SEGMENT_DATA_SIZE);
+#endif
+    if (!prefetcher.layout_buffer) {
+        LOG_ERROR("Failed to allocate prefetch buffer");
+        return -1;
+    }
+    pthread_mutex_init(&prefetcher.lock, NULL);
+    pthread_cond_init(&prefetcher.cond, NULL);
+    if (pthread_create(&prefetcher.thread, NULL, prefetch_thread, NULL) != 0) {
+        LOG_ERROR("Failed to start prefetch thread");
+        free(prefetcher.layout_buffer);
+        prefetcher.layout_buffer = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void prefetch_stop(void) {
+    if (!prefetcher.layout_buffer) {
+        return;
+    }
+    pthread_mutex_lock(&prefetcher.lock);
+    prefetcher.quit = true;
+    pthread_cond_broadcast(&prefetcher.cond);
+    pthread_mutex_unlock(&prefetcher.lock);
+    pthread_join(prefetcher.thread, NULL);
+
+    LOG_INFO("Prefetch: %lu hits, %lu misses", prefetcher.hits, prefetcher.misses);
+    pthread_mutex_destroy(&prefetcher.lock);
+    pthread_cond_destroy(&prefetcher.cond);
+    for (int i = 0; i < prefetcher.slot_count; i++) {
+        free(prefetcher.slots[i].buffer);
+    }
+    free(prefetcher.layout_buffer);
+    prefetcher.layout_buffer = NULL;
+}
+
+static SeqStream* prefetch_find_stream(const char *path) {
+    for (int i = 0; i < PREFETCH_TRACKED_FILES; i++) {
+        if (strcmp(prefetcher.streams[i].path, path) == 0) {
+            return &prefetcher.streams[i];
+        }
+    }
+    return NULL;
+}
+
+static PrefetchSlot* prefetch_find_slot(const char *path) {
+    for (int i = 0; i < prefetcher.slot_count; i++) {
+        if (strcmp(prefetcher.slots[i].path, path) == 0) {
+            return &prefetcher.slots[i];
+        }
+    }
+    return NULL;
+}
+
+/* The slot holding path's read-ahead, or else the least recently used one
+ * whose buffer nobody is reading; NULL when every slot is in use */
+static PrefetchSlot* prefetch_claim_slot(const char *path) {
+    PrefetchSlot *slot = prefetch_find_slot(path);
+    for (int i = 0; i < prefetcher.slot_count && !slot; i++) {
+        PrefetchSlot *candidate = &prefetcher.slots[i];
+        if (candidate->users == 0 && (!slot || candidate->last_used < slot->last_used)) {
+            slot = candidate;
+        }
+    }
+    if (slot) {
+        slot->last_used = ++prefetcher.clock;
+    }
+    return slot;
+}
+
+static bool prefetch_covers(PrefetchSlot *slot, const char *path, uint64_t offset, uint64_t size) {
+    return strcmp(slot->path, path) == 0 && offset >= slot->offset &&
+           offset + size <= slot->offset + slot->size;
+}
+
+/* Return the prefetched bytes for the range, waiting for a read of it that
+ * is still in progress. A hit must be released with prefetch_release(). */
+const uint8_t* prefetch_acquire(const char *path, uint64_t offset, uint64_t size) {
+    const uint8_t *data = NULL;
+    pthread_mutex_lock(&prefetcher.lock);
+
+    PrefetchSlot *slot = prefetch_find_slot(path);
+    bool covered = slot && prefetch_covers(slot, path, offset, size);
+    while (covered && (slot->busy || slot->queued)) {
+        pthread_cond_wait(&prefetcher.cond, &prefetcher.lock);
+        covered = prefetch_covers(slot, path, offset, size);
+    }
+
+    SeqStream *stream = prefetch_find_stream(path);
+    bool sequential = stream && stream->next_offset == offset;
+    if (covered && slot->ready) {
+        slot->users++;
+        slot->last_used = ++prefetcher.clock;
+        prefetcher.hits++;
+        data = slot->data + (offset - slot->offset);
+    } else if (sequential) {
+        prefetcher.misses++;
+    }
+    LOG_DEBUG("Prefetch %s: %lu hits, %lu misses", data ? "hit" : "miss",
+              prefetcher.hits, prefetcher.misses);
+
+    pthread_mutex_unlock(&prefetcher.lock);
+    return data;
+}
+
+/* Release a hit of prefetch_acquire(); a slot keeps its path while used */
+void prefetch_release(const char *path) {
+    pthread_mutex_lock(&prefetcher.lock);
+    prefetch_find_slot(path)->users--;
+    pthread_cond_broadcast(&prefetcher.cond);
+    pthread_mutex_unlock(&prefetcher.lock);
+}
+
+/* Record a served range and queue the following one if the file is being
+ * read sequentially, and the title's layout if it is new. Titles arriving
+ * together queue their layouts in turn; with the queue full, a title is
+ * left unmarked and queued by a later range. */
+void prefetch_note_range(const char *path, uint64_t offset, uint64_t size, uint64_t file_size) {
+    pthread_mutex_lock(&prefetcher.lock);
+
+    bool laid_out = false;
+    for (int i = 0; i < PREFETCH_TRACKED_FILES && !laid_out; i++) {
+        laid_out = strcmp(prefetcher.layouts[i], path) == 0;
+    }
+    if (!laid_out && strlen(path) < MAX_PATH_LEN && prefetcher.layout_queued < PREFETCH_LAYOUT_JOBS) {
+        strcpy(prefetcher.layouts[prefetcher.next_layout], path);
+        prefetcher.next_layout = (prefetcher.next_layout + 1) % PREFETCH_TRACKED_FILES;
+        int tail = (prefetcher.layout_head + prefetcher.layout_queued++) % PREFETCH_LAYOUT_JOBS;
+        strcpy(prefetcher.layout_queue[tail], path);
+        pthread_cond_broadcast(&prefetcher.cond);
+    }
+
+    SeqStream *stream = prefetch_find_stream(path);
+    bool sequential = stream && stream->next_offset == offset;
+    if (!stream) {
+        stream = &prefetcher.streams[prefetcher.next_stream];
+        prefetcher.next_stream = (prefetcher.next_stream + 1) % PREFETCH_TRACKED_FILES;
+        strncpy(stream->path, path, MAX_PATH_LEN - 1);
+        stream->path[MAX_PATH_LEN - 1] = '\0';
+    }
+    stream->next_offset = offset + size;
+
+    PrefetchSlot *slot = sequential && file_size > offset + size ? prefetch_claim_slot(path) : NULL;
+    if (slot) {
+        uint64_t next_size = size < PREFETCH_MAX_SIZE ? size : PREFETCH_MAX_SIZE;
+        if (next_size > file_size - (offset + size)) {
+            next_size = file_size - (offset + size);
+        }
+        strcpy(slot->path, path);
+        slot->offset = offset + size;
+        slot->size = next_size;
+        slot->ready = false;
+        slot->queued = true;
+        pthread_cond_broadcast(&prefetcher.cond);
+    }
+
+    pthread_mutex_unlock(&prefetcher.lock);
+}
+
+#ifndef _WIN32
+/* Title file mapped for zero-copy serving, kept until another title is requested */
+typedef struct {
+    char path[MAX_PATH_LEN];
+    int fd;
+    uint8_t *data;
+    size_t size;
+    struct timespec mtime;
+} MappedTitle;
+
+/* Per session thread, so each console keeps its own mapping */
+static _Thread_local MappedTitle mapped_title = { .fd = -1 };
+
+void mapped_title_close(void) {
+    if (mapped_title.data) {
+        munmap(mapped_title.data, mapped_title.size);
+        mapped_title.data = NULL;
+    }
+    if (mapped_title.fd >= 0) {
+        close(mapped_title.fd);
+        mapped_title.fd = -1;
+    }
+    mapped_title.path[0] = '\0';
+}
+
+/* Map path, reusing the current mapping while the file is unchanged */
+static int mapped_title_open(const char *path) {
+    struct stat st;
+    if (mapped_title.data && strcmp(mapped_title.path, path) == 0 &&
+        fstat(mapped_title.fd, &st) == 0 && (size_t)st.st_size == mapped_title.size &&
+        STAT_MTIME(st).tv_sec == mapped_title.mtime.tv_sec &&
+        STAT_MTIME(st).tv_nsec == mapped_title.mtime.tv_nsec) {
+        return 0;
+    }
+
+    mapped_title_close();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        LOG_DEBUG("mmap failed for %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    mapped_title.fd = fd;
+    mapped_title.data = data;
+    mapped_title.size = st.st_size;
+    mapped_title.mtime = STAT_MTIME(st);
+    strncpy(mapped_title.path, path, MAX_PATH_LEN - 1);
+    mapped_title.path[MAX_PATH_LEN - 1] = '\0';
+    LOG_DEBUG("Mapped %s (%zu bytes)", path, mapped_title.size);
+    return 0;
+}
+
+/* Submit USB transfers straight from the mapped title pages.
+ * Returns 1 when the file cannot be mapped so the caller can fall back. */
+static int stream_range_mapped(UsbContext *ctx, const char *path, uint64_t offset, uint64_t size) {
+    if (mapped_title_open(path) < 0) {
+        return 1;
+    }
+    if (offset > mapped_title.size || size > mapped_title.size - offset) {
+        LOG_ERROR("Requested range is beyond end of file");
+        return -1;
+    }
+
+    /* Advice values are not flags, so each needs its own call */
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t advise_start = offset & ~((uint64_t)page_size - 1);
+    uint64_t advise_len = offset + size - advise_start;
+    if (madvise(mapped_title.data + advise_start, advise_len, MADV_SEQUENTIAL) != 0) {
+        LOG_DEBUG("madvise(MADV_SEQUENTIAL) failed: %s", strerror(errno));
+    }
+    if (madvise(mapped_title.data + advise_start, advise_len, MADV_WILLNEED) != 0) {
+        LOG_DEBUG("madvise(MADV_WILLNEED) failed: %s", strerror(errno));
+    }
+
+    uint64_t curr_off = 0;
+    uint32_t chunk = BUFFER_SEGMENT_DATA_SIZE;
+    int ret = 0;
+
+    while (curr_off < size) {
+        if (curr_off + chunk >= size) {
+            chunk = size - curr_off;
+        }
+
+        UsbTxSlot *slot = usb_tx_acquire(ctx);
+        if (!slot || usb_tx_submit(ctx, slot, mapped_title.data + offset + curr_off, chunk) < 0) {
+            ret = -1;
+            break;
+        }
+        curr_off += chunk;
+    }
+
+    if (usb_tx_flush(ctx) < 0) {
+        ret = -1;
+    }
+    return ret;
+}
+#endif
+
+#ifdef HAVE_LIBURING
+/* io_uring reader: keeps a read in flight for every free ring slot, using
+ * the transfer buffers and the title fd as registered resources */
+typedef struct {
+    struct io_uring uring;
+    uint64_t generation;
+    bool ready;
+    bool unavailable;
+    bool fixed_buffers;
+    bool fixed_file;
+} UringReader;
+
+/* Per session thread; the registered buffers are that session's ring, and
+ * a session that cannot use io_uring falls back without affecting others */
+static _Thread_local UringReader uring_reader;
+
+void uring_reader_close(void) {
+    if (uring_reader.ready) {
+        io_uring_queue_exit(&uring_reader.uring);
+        uring_reader.ready = false;
+    }
+    uring_reader.unavailable = false;
+}
+
+static int uring_reader_setup(UsbTxRing *ring) {
+    if (uring_reader.unavailable) {
+        return -1;
+    }
+    if (uring_reader.ready && uring_reader.generation == ring->generation) {
+        return 0;
+    }
+    uring_reader_close();
+
+    int ret = io_uring_queue_init(ring->size, &uring_reader.uring, 0);
+    if (ret < 0) {
+        LOG_WARNING("io_uring unavailable (%s), using buffered reads", strerror(-ret));
+        uring_reader.unavailable = true;
+        return -1;
+    }
+    uring_reader.ready = true;
+    uring_reader.generation = ring->generation;
+
+    struct iovec *iov = calloc(ring->size, sizeof(struct iovec));
+    if (iov) {
+        for (int i = 0; i < ring->size; i++) {
+            iov[i].iov_base = ring->slots[i].buffer;
+            iov[i].iov_len = BUFFER_SEGMENT_DATA_SIZE;
+        }
+        uring_reader.fixed_buffers = io_uring_register_buffers(&uring_reader.uring, iov, ring->size) == 0;
+        free(iov);
+    }
+
+    int sparse_fd = -1;
+    uring_reader.fixed_file = io_uring_register_files(&uring_reader.uring, &sparse_fd, 1) == 0;
+
+    LOG_DEBUG("io_uring reader: depth %d, fixed buffers %s, fixed file %s", ring->size,
+              uring_reader.fixed_buffers ? "yes" : "no", uring_reader.fixed_file ? "yes" : "no");
+    return 0;
+}
+
+/* Queue the read of chunk seq into its ring slot */
+static void uring_queue_read(UsbTxRing *ring, int fd, int seq, uint64_t offset, uint32_t len) {
+    int index = seq % ring->size;
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&uring_reader.uring);
+
+    if (uring_reader.fixed_buffers) {
+        io_uring_prep_read_fixed(sqe, uring_reader.fixed_file ? 0 : fd,
+                                 ring->slots[index].buffer, len, offset, index);
+    } else {
+        io_uring_prep_read(sqe, uring_reader.fixed_file ? 0 : fd,
+                           ring->slots[index].buffer, len, offset);
+    }
+    if (uring_reader.fixed_file) {
+        io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    }
+    io_uring_sqe_set_data64(sqe, ((uint64_t)seq << 32) | len);
+}
+
+/* Stream a range reading through io_uring. Returns 1 when io_uring cannot
+ * be used so the caller can fall back to synchronous reads. */
+static int stream_range_uring(UsbContext *ctx, const char *path, uint64_t offset, uint64_t size) {
+    UsbTxRing *ring = &ctx->tx;
+    if (uring_reader_setup(ring) < 0) {
+        return 1;
+    }
+
+    uint64_t file_size;
+    bool drop_cache;
+    int fd = fd_cache_acquire(path, false, &file_size, &drop_cache);
+    if (fd < 0) {
+        LOG_ERROR("Failed to open file: %s", path);
+        return -1;
+    }
+    if (uring_reader.fixed_file && io_uring_register_files_update(&uring_reader.uring, 0, &fd, 1) < 0) {
+        uring_reader.fixed_file = false;
+    }
+
+    int chunks = (size + BUFFER_SEGMENT_DATA_SIZE - 1) / BUFFER_SEGMENT_DATA_SIZE;
+    int read_seq = 0;
+    int send_seq = 0;
+    int wait_seq = 0;
+    int reads_pending = 0;
+    int ret = 0;
+
+    while (send_seq < chunks && ret == 0) {
+        /* A slot can be read into again once its previous transfer is reaped */
+        int queued = 0;
+        while (read_seq < chunks && read_seq - ring->size < wait_seq) {
+            uint64_t chunk_off = (uint64_t)read_seq * BUFFER_SEGMENT_DATA_SIZE;
+            uint32_t len = size - chunk_off < BUFFER_SEGMENT_DATA_SIZE ?
+                           size - chunk_off : BUFFER_SEGMENT_DATA_SIZE;
+            uring_queue_read(ring, fd, read_seq, offset + chunk_off, len);
+            read_seq++;
+            queued++;
+        }
+        if (queued) {
+            io_uring_submit(&uring_reader.uring);
+            reads_pending += queued;
+        }
+
+        /* Keep at most depth transfers in flight */
+        if (wait_seq <= send_seq - ring->depth) {
+            if (usb_tx_wait_slot(ctx, &ring->slots[wait_seq % ring->size]) < 0) {
+                ret = -1;
+            }
+            wait_seq++;
+            continue;
+        }
+
+        UsbTxSlot *slot = &ring->slots[send_seq % ring->size];
+        if (!slot->filled) {
+            if (send_seq >= read_seq) {
+                /* The slot still carries an older transfer */
+                if (usb_tx_wait_slot(ctx, &ring->slots[wait_seq % ring->size]) < 0) {
+                    ret = -1;
+                }
+                wait_seq++;
+                continue;
+            }
+
+            struct io_uring_cqe *cqe;
+            if (io_uring_wait_cqe(&uring_reader.uring, &cqe) < 0) {
+                ret = -1;
+                break;
+            }
+            uint64_t data = io_uring_cqe_get_data64(cqe);
+            int res = cqe->res;
+            io_uring_cqe_seen(&uring_reader.uring, cqe);
+            reads_pending--;
+
+            if (res != (int)(uint32_t)data) {
+                LOG_ERROR("Failed to read from file: %s", res < 0 ? strerror(-res) : "short read");
+                ret = -1;
+                break;
+            }
+            ring->slots[(data >> 32) % ring->size].filled = res;
+            continue;
+        }
+
+        if (usb_tx_submit(ctx, slot, slot->buffer, slot->filled) < 0) {
+            ret = -1;
+            break;
+        }
+        slot->filled = 0;
+        send_seq++;
+    }
+
+    while (reads_pending > 0) {
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(&uring_reader.uring, &cqe) < 0) {
+            break;
+        }
+        io_uring_cqe_seen(&uring_reader.uring, cqe);
+        reads_pending--;
+    }
+    for (int i = 0; i < ring->size; i++) {
+        ring->slots[i].filled = 0;
+    }
+
+    if (usb_tx_flush(ctx) < 0) {
+        ret = -1;
+    }
+    if (uring_reader.fixed_file) {
+        int sparse_fd = -1;
+        io_uring_register_files_update(&uring_reader.uring, 0, &sparse_fd, 1);
+    }
+    fd_cache_release(fd);
+    return ret;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/* Host-side NSZ/XCZ decompression. An NSZ is an NSP whose NCAs were
+ * stored as NCZ: the first 0x4000 bytes of the NCA as they were, a table
+ * of the NCA sections with their AES-CTR keys, then the decrypted rest of
+ * the NCA compressed with zstd, either in independent blocks or as one
+ * solid stream. With --decompress these titles are listed as NSP/XCI and
+ * served as the title they were compressed from: partition headers are
+ * rewritten for the .nca entries, NCZ data is decompressed by a pool of
+ * threads and encrypted again on its way to the console. */
+static const uint8_t aes_sbox[256] = {
+    0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+    0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+    0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+    0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+    0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+    0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+    0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+    0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+    0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+    0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+    0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+    0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+    0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+    0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+    0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+    0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16
+};
+
+/* SubBytes and MixColumns of one byte of row 0, bytes packed row 0 first */
+static uint32_t aes_te[256];
+static bool aes_ni = false;
+static pthread_once_t aes_te_once = PTHREAD_ONCE_INIT;
+
+static void aes_te_init(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t s = aes_sbox[i];
+        uint32_t s2 = ((s << 1) ^ ((s >> 7) * 0x1b)) & 0xff;
+        aes_te[i] = s2 | s << 8 | s << 16 | (s2 ^ s) << 24;
+    }
+#ifdef HAVE_AESNI
+    aes_ni = __builtin_cpu_supports("aes");
+#endif
+}
+
+static uint32_t aes_rotl(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static uint32_t aes_load(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t aes_sub_word(uint32_t x) {
+    return aes_sbox[x & 0xff] | aes_sbox[(x >> 8) & 0xff] << 8 |
+           aes_sbox[(x >> 16) & 0xff] << 16 | (uint32_t)aes_sbox[x >> 24] << 24;
+}
+
+/* AES-128, encryption only: CTR mode never runs the inverse cipher */
+typedef struct {
+    uint32_t round_keys[44];
+} Aes128;
+
+static void aes128_init(Aes128 *aes, const uint8_t *key) {
+    static const uint8_t rcon[10] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+    pthread_once(&aes_te_once, aes_te_init);
+    uint32_t *w = aes->round_keys;
+    for (int i = 0; i < 4; i++) {
+        w[i] = aes_load(key + i * 4);
+    }
+    for (int i = 4; i < 44; i++) {
+        uint32_t t = w[i - 1];
+        if (i % 4 == 0) {
+            t = aes_sub_word(aes_rotl(t, 24)) ^ rcon[i / 4 - 1];
+        }
+        w[i] = w[i - 4] ^ t;
+    }
+}
+
+static void aes128_encrypt(const Aes128 *aes, const uint8_t *in, uint8_t *out) {
+    const uint32_t *rk = aes->round_keys;
+    uint32_t s[4], t[4];
+    for (int c = 0; c < 4; c++) {
+        s[c] = aes_load(in + c * 4) ^ rk[c];
+    }
+    for (int round = 1; round < 10; round++) {
+        for (int c = 0; c < 4; c++) {
+            t[c] = aes_te[s[c] & 0xff] ^
+                   aes_rotl(aes_te[(s[(c + 1) & 3] >> 8) & 0xff], 8) ^
+                   aes_rotl(aes_te[(s[(c + 2) & 3] >> 16) & 0xff], 16) ^
+                   aes_rotl(aes_te[s[(c + 3) & 3] >> 24], 24) ^ rk[round * 4 + c];
+        }
+        memcpy(s, t, sizeof(s));
+    }
+    for (int c = 0; c < 4; c++) {
+        uint32_t v = (aes_sbox[s[c] & 0xff] | aes_sbox[(s[(c + 1) & 3] >> 8) & 0xff] << 8 |
+                      aes_sbox[(s[(c + 2) & 3] >> 16) & 0xff] << 16 |
+                      (uint32_t)aes_sbox[s[(c + 3) & 3] >> 24] << 24) ^ rk[40 + c];
+        out[c * 4] = v;
+        out[c * 4 + 1] = v >> 8;
+        out[c * 4 + 2] = v >> 16;
+        out[c * 4 + 3] = v >> 24;
+    }
+}
+
+#ifdef HAVE_AESNI
+/* CTR over count whole blocks with AES-NI, eight blocks in flight. The
+ * round keys are laid out in memory as the instructions expect them. */
+__attribute__((target("aes,sse2")))
+static void aes_ctr_xor_ni(const Aes128 *aes, const uint8_t *nonce, uint64_t block,
+                           uint8_t *data, uint64_t count) {
+    __m128i keys[11];
+    for (int i = 0; i < 11; i++) {
+        keys[i] = _mm_loadu_si128((const __m128i*)(aes->round_keys + i * 4));
+    }
+    uint8_t counter[16];
+    memcpy(counter, nonce, 8);
+    while (count > 0) {
+        int n = count < 8 ? (int)count : 8;
+        __m128i s[8];
+        for (int i = 0; i < n; i++) {
+            uint64_t be = __builtin_bswap64(block + i);
+            memcpy(counter + 8, &be, 8);
+            s[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)counter), keys[0]);
+        }
+        for (int r = 1; r < 10; r++) {
+            for (int i = 0; i < n; i++) {
+                s[i] = _mm_aesenc_si128(s[i], keys[r]);
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            __m128i *p = (__m128i*)(data + i * 16);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), _mm_aesenclast_si128(s[i], keys[10])));
+        }
+        data += n * 16;
+        block += n;
+        count -= n;
+    }
+}
+#endif
+
+/* XOR the AES-CTR keystream into data found at offset of the NCA. The
+ * counter is the section nonce with offset / 16, big-endian, below it. */
+static void aes_ctr_xor(const Aes128 *aes, const uint8_t *nonce, uint64_t offset,
+                        uint8_t *data, uint64_t size) {
+    uint8_t counter[16];
+    uint8_t stream[16];
+    memcpy(counter, nonce, 8);
+    for (uint64_t done = 0; done < size; ) {
+        uint64_t block = (offset + done) >> 4;
+#ifdef HAVE_AESNI
+        if (aes_ni && ((offset + done) & 15) == 0 && size - done >= 16) {
+            uint64_t whole = (size - done) & ~(uint64_t)15;
+            aes_ctr_xor_ni(aes, nonce, block, data + done, whole / 16);
+            done += whole;
+            continue;
+        }
+#endif
+        for (int i = 0; i < 8; i++) {
+            counter[15 - i] = block >> (i * 8);
+        }
+        aes128_encrypt(aes, counter, stream);
+        uint32_t skip = (offset + done) & 15;
+        uint64_t n = 16 - skip < size - done ? 16 - skip : size - done;
+        for (uint64_t i = 0; i < n; i++) {
+            data[done + i] ^= stream[skip + i];
+        }
+        done += n;
+    }
+}
+
+static uint32_t sha256_ror(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+/* SHA-256 of a buffer, for the XCI partition header hashes */
+static void sha256(const uint8_t *data, size_t size, uint8_t *digest) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    size_t blocks = (size + 9 + 63) / 64;
+    for (size_t b = 0; b < blocks; b++) {
+        /* The message, a 0x80 byte, zeros and the bit length in the last block */
+        uint8_t block[64] = {0};
+        size_t off = b * 64;
+        if (off < size) {
+            memcpy(block, data + off, size - off < 64 ? size - off : 64);
+        }
+        if (size >= off && size < off + 64) {
+            block[size - off] = 0x80;
+        }
+        if (b == blocks - 1) {
+            for (int i = 0; i < 8; i++) {
+                block[63 - i] = ((uint64_t)size * 8) >> (i * 8);
+            }
+        }
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[i * 4] << 24 | block[i * 4 + 1] << 16 |
+                   block[i * 4 + 2] << 8 | block[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = sha256_ror(w[i - 15], 7) ^ sha256_ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = sha256_ror(w[i - 2], 17) ^ sha256_ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t v[8];
+        memcpy(v, h, sizeof(v));
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = sha256_ror(v[4], 6) ^ sha256_ror(v[4], 11) ^ sha256_ror(v[4], 25);
+            uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+            uint32_t t1 = v[7] + s1 + ch + k[i] + w[i];
+            uint32_t s0 = sha256_ror(v[0], 2) ^ sha256_ror(v[0], 13) ^ sha256_ror(v[0], 22);
+            uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+            memmove(v + 1, v, 7 * sizeof(uint32_t));
+            v[4] += t1;
+            v[0] = t1 + s0 + maj;
+        }
+        for (int i = 0; i < 8; i++) {
+            h[i] += v[i];
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = h[i] >> 24;
+        digest[i * 4 + 1] = h[i] >> 16;
+        digest[i * 4 + 2] = h[i] >> 8;
+        digest[i * 4 + 3] = h[i];
+    }
+}
+
+/* NCA section as recorded in the NCZ section table */
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t crypto_type;
+    uint8_t nonce[8];
+    Aes128 aes;
+} NczSection;
+
+/* Frame boundary in a solid stream where decoding can start over */
+typedef struct {
+    uint64_t in;
+    uint64_t out;
+} NczCheckpoint;
+
+/* Compressed NCA body. Offsets are into the decompressed body, which
+ * starts at NCA offset NCZ_HEADER_SIZE. */
+typedef struct {
+    uint64_t data;
+    uint64_t data_end;
+    uint64_t size;
+    NczSection *sections;
+    uint32_t section_count;
+    /* Block mode: file offset of every block and of the end of the last */
+    uint64_t *blocks;
+    uint32_t block_count;
+    uint32_t block_shift;
+    /* The lock guards the held block and the solid decoder */
+    pthread_mutex_t lock;
+    /* Block mode: a block only partly sent, which the next request needs */
+    uint8_t *held;
+    uint64_t held_block;
+    /* Solid mode: decoder state, input window and restart points */
+    ZSTD_DStream *dstream;
+    uint8_t *in_buf;
+    ZSTD_inBuffer in;
+    uint64_t in_file;
+    uint64_t out_pos;
+    NczCheckpoint *checkpoints;
+    uint32_t checkpoint_count;
+    uint32_t checkpoint_cap;
+} NczStream;
+
+typedef enum {
+    EXTENT_COPY,    /* bytes of the compressed file, unchanged */
+    EXTENT_MEMORY,  /* rewritten header held in memory */
+    EXTENT_NCZ      /* decompressed NCA body */
+} ExtentKind;
+
+/* Piece of a decompressed title, in title order */
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    ExtentKind kind;
+    uint64_t source;
+    uint8_t *data;
+    NczStream *ncz;
+} TitleExtent;
+
+/* Layout of a title as served decompressed. Extents never change once
+ * built; titles in the cache are shared by every session. */
+typedef struct {
+    char path[MAX_PATH_LEN];
+    BlockFile file;
+    uint64_t size;
+    TitleExtent *extents;
+    uint32_t extent_count;
+    uint32_t extent_cap;
+    uint32_t ncz_count;
+    size_t buffer_size;
+    int refs;
+    bool cached;
+    uint64_t last_used;
+} DecompressedTitle;
+
+static struct {
+    pthread_mutex_t lock;
+    DecompressedTitle *titles[DECOMPRESSED_TITLES];
+    uint64_t clock;
+} decompressed = { PTHREAD_MUTEX_INITIALIZER, {0}, 0 };
+
+static void ncz_free(NczStream *ncz) {
+    if (!ncz) {
+        return;
+    }
+    if (ncz->dstream) {
+        ZSTD_freeDStream(ncz->dstream);
+    }
+    pthread_mutex_destroy(&ncz->lock);
+    free(ncz->sections);
+    free(ncz->blocks);
+    free(ncz->held);
+    free(ncz->in_buf);
+    free(ncz->checkpoints);
+    free(ncz);
+}
+
+/* Parse the NCZ stored at source; returns NULL if it is not one we can read */
+static NczStream* ncz_open(int fd, uint64_t source, uint64_t size) {
+    uint8_t head[0x18];
+    uint64_t pos = source + NCZ_HEADER_SIZE;
+    if (size < NCZ_HEADER_SIZE + 0x10 || pread_full(fd, head, 0x10, pos) != 0x10 ||
+        memcmp(head, "NCZSECTN", 8) != 0) {
+        return NULL;
+    }
+    uint64_t count = *(uint64_t*)(head + 8);
+    if (count == 0 || count > NCZ_MAX_SECTIONS) {
+        return NULL;
+    }
+    pos += 0x10;
+
+    NczStream *ncz = calloc(1, sizeof(NczStream));
+    if (!ncz || !(ncz->sections = calloc(count, sizeof(NczSection)))) {
+        free(ncz);
+        return NULL;
+    }
+    pthread_mutex_init(&ncz->lock, NULL);
+    ncz->held_block = UINT64_MAX;
+    ncz->data_end = source + size;
+    ncz->section_count = count;
+
+    uint64_t nca_end = NCZ_HEADER_SIZE;
+    for (uint32_t i = 0; i < count; i++, pos += NCZ_SECTION_SIZE) {
+        uint8_t raw[NCZ_SECTION_SIZE];
+        NczSection *s = &ncz->sections[i];
+        if (pread_full(fd, raw, sizeof(raw), pos) != sizeof(raw)) {
+            ncz_free(ncz);
+            return NULL;
+        }
+        s->offset = *(uint64_t*)raw;
+        s->size = *(uint64_t*)(raw + 8);
+        s->crypto_type = *(uint64_t*)(raw + 0x10);
+        memcpy(s->nonce, raw + 0x30, 8);
+        aes128_init(&s->aes, raw + 0x20);
+        if (s->size > UINT64_MAX / 2 || s->offset > UINT64_MAX / 2) {
+            ncz_free(ncz);
+            return NULL;
+        }
+        if (s->offset + s->size > nca_end) {
+            nca_end = s->offset + s->size;
+        }
+    }
+    ncz->size = nca_end - NCZ_HEADER_SIZE;
+
+    if (pread_full(fd, head, 0x18, pos) == 0x18 && memcmp(head, "NCZBLOCK", 8) == 0) {
+        uint32_t shift = head[11];
+        uint32_t block_count = *(uint32_t*)(head + 12);
+        uint32_t *sizes = NULL;
+        pos += 0x18;
+        if (shift < NCZ_MIN_BLOCK_SHIFT || shift > NCZ_MAX_BLOCK_SHIFT ||
+            block_count != (ncz->size + (1ull << shift) - 1) >> shift ||
+            !(sizes = malloc((uint64_t)block_count * 4 + 1)) ||
+            !(ncz->blocks = malloc(((uint64_t)block_count + 1) * sizeof(uint64_t))) ||
+            pread_full(fd, (uint8_t*)sizes, (uint64_t)block_count * 4, pos) != (ssize_t)block_count * 4) {
+            free(sizes);
+            ncz_free(ncz);
+            return NULL;
+        }
+        pos += (uint64_t)block_count * 4;
+        for (uint32_t i = 0; i < block_count; i++) {
+            ncz->blocks[i] = pos;
+            pos += sizes[i];
+        }
+        ncz->blocks[block_count] = pos;
+        ncz->block_count = block_count;
+        ncz->block_shift = shift;
+        free(sizes);
+    }
+    ncz->data = ncz->blocks ? ncz->blocks[0] : pos;
+    if (pos > ncz->data_end) {
+        ncz_free(ncz);
+        return NULL;
+    }
+    return ncz;
+}
+
+/* Append an extent taking ownership of data and ncz */
+static bool title_add_extent(DecompressedTitle *title, ExtentKind kind, uint64_t size,
+                             uint64_t source, uint8_t *data, NczStream *ncz) {
+    if (size == 0 || !grow_array((void**)&title->extents, &title->extent_cap,
+                                 title->extent_count, sizeof(TitleExtent))) {
+        free(data);
+        ncz_free(ncz);
+        return size == 0;
+    }
+    TitleExtent *extent = &title->extents[title->extent_count++];
+    extent->offset = title->size;
+    extent->size = size;
+    extent->kind = kind;
+    extent->source = source;
+    extent->data = data;
+    extent->ncz = ncz;
+    title->size += size;
+    return true;
+}
+
+static void decompressed_title_free(DecompressedTitle *title) {
+    for (uint32_t i = 0; i < title->extent_count; i++) {
+        free(title->extents[i].data);
+        ncz_free(title->extents[i].ncz);
+    }
+    free(title->extents);
+    free(title);
+}
+
+/* Read the PFS0/HFS0 header at offset into a buffer the caller frees */
+static uint8_t* read_partition_header(int fd, uint64_t offset, uint64_t *size) {
+    uint8_t head[0x10];
+    if (pread_full(fd, head, sizeof(head), offset) != sizeof(head)) {
+        return NULL;
+    }
+    *size = partition_header_size(head);
+    if (*size == 0 || *size > BUFFER_SEGMENT_DATA_SIZE) {
+        return NULL;
+    }
+    uint8_t *buf = malloc(*size);
+    if (buf && pread_full(fd, buf, *size, offset) != (ssize_t)*size) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/* Lay out the partition at offset as it was before compression: its header
+ * with every .ncz entry turned back into a .nca of the original size, then
+ * the entries packed in table order. The rewritten header is left in
+ * *header, owned by the title. */
+static bool decompressed_partition(DecompressedTitle *title, int fd, uint64_t offset,
+                                   uint64_t file_size, uint8_t **header, uint64_t *header_size) {
+    uint64_t buf_size;
+    uint8_t *buf = read_partition_header(fd, offset, &buf_size);
+    if (!buf || !title_add_extent(title, EXTENT_MEMORY, buf_size, 0, buf, NULL)) {
+        return false;
+    }
+    bool hfs0 = memcmp(buf, "HFS0", 4) == 0;
+    uint32_t count = *(uint32_t*)(buf + 4);
+    uint32_t strings_len = *(uint32_t*)(buf + 8);
+    uint32_t entry_size = hfs0 ? HFS0_ENTRY_SIZE : PFS0_ENTRY_SIZE;
+    char *strings = (char*)buf + 0x10 + (uint64_t)count * entry_size;
+
+    uint64_t data_offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t *entry = buf + 0x10 + (uint64_t)i * entry_size;
+        uint64_t source = offset + buf_size + *(uint64_t*)entry;
+        uint64_t size = *(uint64_t*)(entry + 8);
+        uint32_t name_off = *(uint32_t*)(entry + 16);
+        char *name = name_off < strings_len ? strings + name_off : NULL;
+        size_t name_len = name ? strnlen(name, strings_len - name_off) : 0;
+        if (size > file_size || source > file_size - size) {
+            return false;
+        }
+
+        *(uint64_t*)entry = data_offset;
+        if (name && name_has_suffix(name, name_len, ".ncz")) {
+            NczStream *ncz = ncz_open(fd, source, size);
+            if (!ncz) {
+                LOG_ERROR("Cannot decompress %.*s", (int)name_len, name);
+                return false;
+            }
+            size = NCZ_HEADER_SIZE + ncz->size;
+            name[name_len - 1] = name[name_len - 1] == 'Z' ? 'A' : 'a';
+            *(uint64_t*)(entry + 8) = size;
+            title->ncz_count++;
+            if (ncz->blocks && ((size_t)1 << ncz->block_shift) > title->buffer_size) {
+                title->buffer_size = (size_t)1 << ncz->block_shift;
+            }
+            if (!title_add_extent(title, EXTENT_COPY, NCZ_HEADER_SIZE, source, NULL, NULL)) {
+                ncz_free(ncz);
+                return false;
+            }
+            if (!title_add_extent(title, EXTENT_NCZ, ncz->size, 0, NULL, ncz)) {
+                return false;
+            }
+        } else if (!title_add_extent(title, EXTENT_COPY, size, source, NULL, NULL)) {
+            return false;
+        }
+        data_offset += size;
+    }
+    if (header) {
+        *header = buf;
+        *header_size = buf_size;
+    }
+    return true;
+}
+
+/* Lay out an XCZ as its XCI: the card header and root HFS0 are rewritten
+ * for the new partition sizes, with the header hashes that cover them */
+static bool decompressed_xci(DecompressedTitle *title, int fd, uint64_t file_size) {
+    uint8_t xci[XCI_HEADER_SIZE];
+    if (pread_full(fd, xci, sizeof(xci), 0) != sizeof(xci) || memcmp(xci + 0x100, "HEAD", 4) != 0) {
+        return false;
+    }
+    uint64_t root = *(uint64_t*)(xci + 0x130);
+    uint8_t *head = root >= XCI_HEADER_SIZE && root <= BUFFER_SEGMENT_DATA_SIZE ? malloc(root) : NULL;
+    if (!head || pread_full(fd, head, root, 0) != (ssize_t)root) {
+        free(head);
+        return false;
+    }
+    if (!title_add_extent(title, EXTENT_MEMORY, root, 0, head, NULL)) {
+        return false;
+    }
+
+    uint64_t root_size;
+    uint8_t *root_buf = read_partition_header(fd, root, &root_size);
+    if (!root_buf || memcmp(root_buf, "HFS0", 4) != 0) {
+        free(root_buf);
+        return false;
+    }
+    if (!title_add_extent(title, EXTENT_MEMORY, root_size, 0, root_buf, NULL)) {
+        return false;
+    }
+    uint32_t count = *(uint32_t*)(root_buf + 4);
+    if (count > XCI_MAX_PARTITIONS) {
+        return false;
+    }
+
+    uint64_t data_offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t *entry = root_buf + 0x10 + i * HFS0_ENTRY_SIZE;
+        uint64_t start = title->size;
+        uint8_t *part;
+        uint64_t part_size;
+        if (!decompressed_partition(title, fd, root + root_size + *(uint64_t*)entry, file_size,
+                                    &part, &part_size)) {
+            return false;
+        }
+        uint32_t hashed = *(uint32_t*)(entry + 0x14);
+        *(uint64_t*)entry = data_offset;
+        *(uint64_t*)(entry + 8) = title->size - start;
+        if (hashed <= part_size) {
+            sha256(part, hashed, entry + 0x20);
+        }
+        data_offset += title->size - start;
+    }
+    uint64_t root_hashed = *(uint64_t*)(head + 0x138);
+    if (root_hashed <= root_size) {
+        sha256(root_buf, root_hashed, head + 0x140);
+    }
+    return true;
+}
+
+static DecompressedTitle* decompressed_title_build(const char *path, int fd, const struct stat *st) {
+    DecompressedTitle *title = calloc(1, sizeof(DecompressedTitle));
+    if (!title) {
+        LOG_ERROR("Failed to allocate memory for %s", path);
+        return NULL;
+    }
+    snprintf(title->path, sizeof(title->path), "%s", path);
+    block_file_of(&title->file, st);
+    title->buffer_size = BUFFER_SEGMENT_DATA_SIZE;
+
+    uint8_t magic[4];
+    bool ok = pread_full(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+              (memcmp(magic, "PFS0", 4) == 0 ?
+               decompressed_partition(title, fd, 0, st->st_size, NULL, NULL) :
+               decompressed_xci(title, fd, st->st_size));
+    if (!ok) {
+        LOG_ERROR("Failed to read the layout of %s", path);
+        decompressed_title_free(title);
+        return NULL;
+    }
+    LOG_INFO("Serving %s decompressed: %u NCZ, %lu bytes",
+             path, title->ncz_count, (unsigned long)title->size);
+    return title;
+}
+
+/* Take the decompressed layout of path, building it when the file is new
+ * or has changed; *fd is an open descriptor for the compressed file */
+static DecompressedTitle* decompressed_title_acquire(const char *path, int *fd) {
+    uint64_t file_size;
+    bool drop_cache;
+    struct stat st;
+    *fd = fd_cache_acquire(path, false, &file_size, &drop_cache);
+    if (*fd < 0 || fstat(*fd, &st) != 0) {
+        LOG_ERROR("Failed to open file: %s", path);
+        if (*fd >= 0) {
+            fd_cache_release(*fd);
+        }
+        return NULL;
+    }
+    BlockFile file;
+    block_file_of(&file, &st);
+
+    pthread_mutex_lock(&decompressed.lock);
+    for (int i = 0; i < DECOMPRESSED_TITLES; i++) {
+        DecompressedTitle *title = decompressed.titles[i];
+        if (!title || strcmp(title->path, path) != 0) {
+            continue;
+        }
+        if (memcmp(&title->file, &file, sizeof(file)) == 0) {
+            title->refs++;
+            title->last_used = ++decompressed.clock;
+            pthread_mutex_unlock(&decompressed.lock);
+            return title;
+        }
+        decompressed.titles[i] = NULL;
+        title->cached = false;
+        if (title->refs == 0) {
+            decompressed_title_free(title);
+        }
+    }
+    pthread_mutex_unlock(&decompressed.lock);
+
+    DecompressedTitle *title = decompressed_title_build(path, *fd, &st);
+    if (!title) {
+        fd_cache_release(*fd);
+        return NULL;
+    }
+    title->refs = 1;
+
+    /* Keep it in a free slot, or in place of the least recently used idle one */
+    pthread_mutex_lock(&decompressed.lock);
+    int victim = -1;
+    for (int i = 0; i < DECOMPRESSED_TITLES; i++) {
+        DecompressedTitle *other = decompressed.titles[i];
+        if (!other) {
+            victim = i;
+            break;
+        }
+        if (other->refs == 0 &&
+            (victim < 0 || other->last_used < decompressed.titles[victim]->last_used)) {
+            victim = i;
+        }
+    }
+    if (victim >= 0) {
+        if (decompressed.titles[victim]) {
+            decompressed_title_free(decompressed.titles[victim]);
+        }
+        decompressed.titles[victim] = title;
+        title->cached = true;
+        title->last_used = ++decompressed.clock;
+    }
+    pthread_mutex_unlock(&decompressed.lock);
+    return title;
+}
+
+static void decompressed_title_release(DecompressedTitle *title, int fd) {
+    pthread_mutex_lock(&decompressed.lock);
+    if (--title->refs == 0 && !title->cached) {
+        decompressed_title_free(title);
+    }
+    pthread_mutex_unlock(&decompressed.lock);
+    fd_cache_release(fd);
+}
+
+void decompressed_titles_free(void) {
+    pthread_mutex_lock(&decompressed.lock);
+    for (int i = 0; i < DECOMPRESSED_TITLES; i++) {
+        if (decompressed.titles[i]) {
+            decompressed_title_free(decompressed.titles[i]);
+            decompressed.titles[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&decompressed.lock);
+}
+
+/* Part of a reply being filled by the decompression workers: consecutive
+ * ring slots, one segment each, cut into jobs no wider than an NCZ block */
+typedef struct {
+    const TitleExtent *extent;
+    uint64_t offset;
+    uint64_t size;
+} DecompressJob;
+
+typedef struct DecompressWindow DecompressWindow;
+
+struct DecompressWindow {
+    DecompressedTitle *title;
+    int fd;
+    UsbTxSlot *slots[USB_MAX_QUEUE_DEPTH];
+    uint64_t offset;
+    uint64_t size;
+    DecompressJob *jobs;
+    uint32_t job_count;
+    uint32_t job_cap;
+    uint32_t next_job;
+    int running;
+    int error;
+    DecompressWindow *next;
+};
+
+/* A pool thread; its decoder context and block buffers are kept between
+ * requests and only grow for titles with larger blocks */
+typedef struct {
+    pthread_t thread;
+    DecompressWindow *window;
+    ZSTD_DCtx *dctx;
+    uint8_t *block;
+    uint8_t *scratch;
+    size_t buffer_size;
+} DecompressWorker;
+
+/* Decompression pool, started with --decompress and shared by every
+ * session: windows waiting to be filled are listed, and idle workers take
+ * jobs from the first one that has any left. The lock guards the list and
+ * the job state of its windows. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    bool quit;
+    DecompressWindow *windows;
+    DecompressWorker workers[MAX_DECOMPRESS_THREADS];
+    int count;
+} DecompressPool;
+
+static DecompressPool decompress_pool;
+
+/* Point *dest at window position pos; returns how much of size fits in its slot */
+static uint64_t window_span(DecompressWindow *window, uint64_t pos, uint64_t size, uint8_t **dest) {
+    uint64_t in_slot = pos % BUFFER_SEGMENT_DATA_SIZE;
+    *dest = window->slots[pos / BUFFER_SEGMENT_DATA_SIZE]->buffer + in_slot;
+    return size < BUFFER_SEGMENT_DATA_SIZE - in_slot ? size : BUFFER_SEGMENT_DATA_SIZE - in_slot;
+}
+
+/* Copy plaintext NCA bytes found at nca_offset into the window, encrypting
+ * the parts that belong to AES-CTR sections */
+static void ncz_emit(NczStream *ncz, DecompressWindow *window, uint64_t pos, uint64_t nca_offset,
+                     const uint8_t *data, uint64_t size) {
+    while (size > 0) {
+        uint8_t *dest;
+        uint64_t len = window_span(window, pos, size, &dest);
+        memcpy(dest, data, len);
+        for (uint32_t i = 0; ncz && i < ncz->section_count; i++) {
+            NczSection *s = &ncz->sections[i];
+            uint64_t from = s->offset > nca_offset ? s->offset : nca_offset;
+            uint64_t to = s->offset + s->size < nca_offset + len ? s->offset + s->size : nca_offset + len;
+            if ((s->crypto_type == NCZ_CRYPTO_CTR || s->crypto_type == NCZ_CRYPTO_BKTR) && from < to) {
+                aes_ctr_xor(&s->aes, s->nonce, from, dest + (from - nca_offset), to - from);
+            }
+        }
+        pos += len;
+        nca_offset += len;
+        data += len;
+        size -= len;
+    }
+}
+
+/* Decode a block into the worker's block buffer; returns its length */
+static int64_t ncz_block_decode(NczStream *ncz, int fd, uint64_t block, DecompressWorker *worker) {
+    uint64_t start = block << ncz->block_shift;
+    uint64_t size = ncz->size - start;
+    if (size > (1ull << ncz->block_shift)) {
+        size = 1ull << ncz->block_shift;
+    }
+
+    pthread_mutex_lock(&ncz->lock);
+    bool held = ncz->held_block == block;
+    if (held) {
+        memcpy(worker->block, ncz->held, size);
+    }
+    pthread_mutex_unlock(&ncz->lock);
+    if (held) {
+        return size;
+    }
+
+    /* Blocks that did not shrink are stored as they are */
+    uint64_t stored = ncz->blocks[block + 1] - ncz->blocks[block];
+    if (stored >= size) {
+        return pread_full(fd, worker->block, size, ncz->blocks[block]) == (ssize_t)size ?
+               (int64_t)size : -1;
+    }
+    if (pread_full(fd, worker->scratch, stored, ncz->blocks[block]) != (ssize_t)stored) {
+        return -1;
+    }
+    size_t n = ZSTD_decompressDCtx(worker->dctx, worker->block, size, worker->scratch, stored);
+    if (ZSTD_isError(n) || n != size) {
+        LOG_ERROR("Corrupt NCZ block %lu: %s", (unsigned long)block,
+                  ZSTD_isError(n) ? ZSTD_getErrorName(n) : "short block");
+        return -1;
+    }
+    return size;
+}
+
+/* Keep a decoded block for the request that continues into it */
+static void ncz_hold(NczStream *ncz, uint64_t block, const uint8_t *data, uint64_t size) {
+    pthread_mutex_lock(&ncz->lock);
+    if (!ncz->held) {
+        ncz->held = malloc((size_t)1 << ncz->block_shift);
+    }
+    if (ncz->held) {
+        memcpy(ncz->held, data, size);
+        ncz->held_block = block;
+    }
+    pthread_mutex_unlock(&ncz->lock);
+}
+
+/* Decode size bytes at offset of a solid stream into the window at pos.
+ * The decoder carries on from where the last read stopped; reads behind
+ * it restart at the nearest frame boundary seen so far. */
+static int ncz_solid_read(NczStream *ncz, DecompressWorker *worker, uint64_t pos,
+                          uint64_t offset, uint64_t size) {
+    DecompressWindow *window = worker->window;
+    int ret = 0;
+    pthread_mutex_lock(&ncz->lock);
+
+    if (ncz->checkpoint_count == 0) {
+        if (!grow_array((void**)&ncz->checkpoints, &ncz->checkpoint_cap, 0, sizeof(NczCheckpoint))) {
+            pthread_mutex_unlock(&ncz->lock);
+            return -1;
+        }
+        ncz->checkpoints[0].in = ncz->data;
+        ncz->checkpoints[0].out = 0;
+        ncz->checkpoint_count = 1;
+    }
+    NczCheckpoint *restart = &ncz->checkpoints[0];
+    for (uint32_t i = 1; i < ncz->checkpoint_count && ncz->checkpoints[i].out <= offset; i++) {
+        restart = &ncz->checkpoints[i];
+    }
+    if (!ncz->dstream || offset < ncz->out_pos || restart->out > ncz->out_pos) {
+        if (!ncz->dstream) {
+            ncz->dstream = ZSTD_createDStream();
+            ncz->in_buf = malloc(ZSTD_DStreamInSize());
+        }
+        if (!ncz->dstream || !ncz->in_buf) {
+            pthread_mutex_unlock(&ncz->lock);
+            return -1;
+        }
+        if (ncz->dstream && offset < ncz->out_pos) {
+            LOG_DEBUG("Restarting solid NCZ at %lu for a read at %lu",
+                      (unsigned long)restart->out, (unsigned long)offset);
+        }
+        ZSTD_DCtx_reset(ncz->dstream, ZSTD_reset_session_only);
+        ncz->in = (ZSTD_inBuffer){ ncz->in_buf, 0, 0 };
+        ncz->in_file = restart->in;
+        ncz->out_pos = restart->out;
+    }
+
+    while (ncz->out_pos < offset + size) {
+        if (ncz->in.pos == ncz->in.size) {
+            ncz->in_file += ncz->in.size;
+            uint64_t want = ZSTD_DStreamInSize();
+            if (want > ncz->data_end - ncz->in_file) {
+                want = ncz->data_end - ncz->in_file;
+            }
+            if (want == 0 || pread_full(window->fd, ncz->in_buf, want, ncz->in_file) != (ssize_t)want) {
+                LOG_ERROR("NCZ stream ends early at %lu", (unsigned long)ncz->out_pos);
+                ret = -1;
+                break;
+            }
+            ncz->in = (ZSTD_inBuffer){ ncz->in_buf, want, 0 };
+        }
+
+        /* Decode exactly up to offset first, so nothing past the read is lost */
+        uint64_t want = ncz->out_pos < offset ? offset - ncz->out_pos : offset + size - ncz->out_pos;
+        ZSTD_outBuffer out = { worker->block, want < BUFFER_SEGMENT_DATA_SIZE ? want : BUFFER_SEGMENT_DATA_SIZE, 0 };
+        size_t n = ZSTD_decompressStream(ncz->dstream, &out, &ncz->in);
+        if (ZSTD_isError(n)) {
+            LOG_ERROR("Corrupt solid NCZ at %lu: %s", (unsigned long)ncz->out_pos, ZSTD_getErrorName(n));
+            ncz->out_pos = UINT64_MAX;
+            ret = -1;
+            break;
+        }
+        if (ncz->out_pos >= offset && out.pos > 0) {
+            ncz_emit(ncz, window, pos + (ncz->out_pos - offset), NCZ_HEADER_SIZE + ncz->out_pos,
+                     worker->block, out.pos);
+        }
+        ncz->out_pos += out.pos;
+
+        NczCheckpoint *last = &ncz->checkpoints[ncz->checkpoint_count - 1];
+        if (n == 0 && ncz->out_pos > last->out &&
+            grow_array((void**)&ncz->checkpoints, &ncz->checkpoint_cap,
+                       ncz->checkpoint_count, sizeof(NczCheckpoint))) {
+            ncz->checkpoints[ncz->checkpoint_count].in = ncz->in_file + ncz->in.pos;
+            ncz->checkpoints[ncz->checkpoint_count].out = ncz->out_pos;
+            ncz->checkpoint_count++;
+        }
+    }
+    pthread_mutex_unlock(&ncz->lock);
+    return ret;
+}
+
+static int decompress_job_run(DecompressWorker *worker, const DecompressJob *job) {
+    DecompressWindow *window = worker->window;
+    const TitleExtent *extent = job->extent;
+    uint64_t pos = job->offset - window->offset;
+    uint64_t rel = job->offset - extent->offset;
+    uint8_t *dest;
+
+    switch (extent->kind) {
+        case EXTENT_MEMORY:
+            ncz_emit(NULL, window, pos, 0, extent->data + rel, job->size);
+            return 0;
+        case EXTENT_COPY:
+            /* Copy jobs never cross a slot */
+            window_span(window, pos, job->size, &dest);
+            return pread_full(window->fd, dest, job->size, extent->source + rel) == (ssize_t)job->size ?
+                   0 : -1;
+        case EXTENT_NCZ:
+            break;
+    }
+
+    NczStream *ncz = extent->ncz;
+    if (!ncz->blocks) {
+        return ncz_solid_read(ncz, worker, pos, rel, job->size);
+    }
+    uint64_t block = rel >> ncz->block_shift;
+    uint64_t from = rel - (block << ncz->block_shift);
+    int64_t len = ncz_block_decode(ncz, window->fd, block, worker);
+    if (len < 0) {
+        return -1;
+    }
+    ncz_emit(ncz, window, pos, NCZ_HEADER_SIZE + rel, worker->block + from, job->size);
+    if (from + job->size < (uint64_t)len) {
+        ncz_hold(ncz, block, worker->block, len);
+    }
+    return 0;
+}
+
+/* Make sure the worker can decode blocks of buffer_size bytes */
+static bool decompress_worker_ready(DecompressWorker *worker, size_t buffer_size) {
+    if (worker->buffer_size < buffer_size) {
+        free(worker->block);
+        free(worker->scratch);
+        worker->block = malloc(buffer_size);
+        worker->scratch = malloc(buffer_size);
+        worker->buffer_size = worker->block && worker->scratch ? buffer_size : 0;
+    }
+    if (!worker->dctx) {
+        worker->dctx = ZSTD_createDCtx();
+    }
+    return worker->buffer_size >= buffer_size && worker->dctx;
+}
+
+static DecompressWindow* decompress_pool_next(void) {
+    for (DecompressWindow *window = decompress_pool.windows; window; window = window->next) {
+        if (!window->error && window->next_job < window->job_count) {
+            return window;
+        }
+    }
+    return NULL;
+}
+
+static void* decompress_worker(void *arg) {
+    DecompressWorker *worker = arg;
+    pthread_mutex_lock(&decompress_pool.lock);
+    while (true) {
+        DecompressWindow *window;
+        while (!decompress_pool.quit && !(window = decompress_pool_next())) {
+            pthread_cond_wait(&decompress_pool.work, &decompress_pool.lock);
+        }
+        if (decompress_pool.quit) {
+            break;
+        }
+        DecompressJob *job = &window->jobs[window->next_job++];
+        window->running++;
+        pthread_mutex_unlock(&decompress_pool.lock);
+
+        worker->window = window;
+        bool ok = decompress_worker_ready(worker, window->title->buffer_size) &&
+                  decompress_job_run(worker, job) == 0;
+
+        pthread_mutex_lock(&decompress_pool.lock);
+        if (!ok) {
+            window->error = -1;
+        }
+        if (--window->running == 0 &&
+            (window->error || window->next_job == window->job_count)) {
+            pthread_cond_broadcast(&decompress_pool.done);
+        }
+    }
+    pthread_mutex_unlock(&decompress_pool.lock);
+    return NULL;
+}
+
+/* Have the pool fill the window's slots and wait until it has */
+static int decompress_pool_run(DecompressWindow *window) {
+    pthread_mutex_lock(&decompress_pool.lock);
+    window->running = 0;
+    window->error = 0;
+    window->next = decompress_pool.windows;
+    decompress_pool.windows = window;
+    pthread_cond_broadcast(&decompress_pool.work);
+    while (window->running > 0 || (!window->error && window->next_job < window->job_count)) {
+        pthread_cond_wait(&decompress_pool.done, &decompress_pool.lock);
+    }
+    DecompressWindow **link = &decompress_pool.windows;
+    while (*link != window) {
+        link = &(*link)->next;
+    }
+    *link = window->next;
+    pthread_mutex_unlock(&decompress_pool.lock);
+    return window->error;
+}
+
+int decompress_pool_start(int threads) {
+    memset(&decompress_pool, 0, sizeof(decompress_pool));
+    pthread_mutex_init(&decompress_pool.lock, NULL);
+    pthread_cond_init(&decompress_pool.work, NULL);
+    pthread_cond_init(&decompress_pool.done, NULL);
+    while (decompress_pool.count < threads &&
+           pthread_create(&decompress_pool.workers[decompress_pool.count].thread, NULL,
+                          decompress_worker, &decompress_pool.workers[decompress_pool.count]) == 0) {
+        decompress_pool.count++;
+    }
+    if (decompress_pool.count == 0) {
+        LOG_ERROR("Failed to start decompression threads");
+        return -1;
+    }
+    LOG_DEBUG("Decompression pool: %d threads", decompress_pool.count);
+    return 0;
+}
+
+void decompress_pool_stop(void) {
+    if (decompress_pool.count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&decompress_pool.lock);
+    decompress_pool.quit = true;
+    pthread_cond_broadcast(&decompress_pool.work);
+    pthread_mutex_unlock(&decompress_pool.lock);
+    for (int i = 0; i < decompress_pool.count; i++) {
+        DecompressWorker *worker = &decompress_pool.workers[i];
+        pthread_join(worker->thread, NULL);
+        ZSTD_freeDCtx(worker->dctx);
+        free(worker->block);
+        free(worker->scratch);
+    }
+    pthread_mutex_destroy(&decompress_pool.lock);
+    pthread_cond_destroy(&decompress_pool.work);
+    pthread_cond_destroy(&decompress_pool.done);
+    decompress_pool.count = 0;
+}
+
+/* Index of the extent holding title offset pos */
+static uint32_t title_extent_find(DecompressedTitle *title, uint64_t pos) {
+    uint32_t lo = 0;
+    uint32_t hi = title->extent_count;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (title->extents[mid].offset <= pos) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Cut the window into jobs: NCZ blocks and slot-sized copies run in
+ * parallel, while a solid stream is decoded by one job per window */
+static bool decompress_window_plan(DecompressWindow *window) {
+    DecompressedTitle *title = window->title;
+    uint64_t end = window->offset + window->size;
+    window->job_count = 0;
+    window->next_job = 0;
+    for (uint32_t i = title_extent_find(title, window->offset); i < title->extent_count; i++) {
+        const TitleExtent *extent = &title->extents[i];
+        uint64_t pos = extent->offset > window->offset ? extent->offset : window->offset;
+        uint64_t extent_end = extent->offset + extent->size < end ? extent->offset + extent->size : end;
+        if (pos >= end) {
+            break;
+        }
+        while (pos < extent_end) {
+            uint64_t piece_end = extent_end;
+            if (extent->kind == EXTENT_NCZ && extent->ncz->blocks) {
+                uint32_t shift = extent->ncz->block_shift;
+                uint64_t block_end = extent->offset + ((((pos - extent->offset) >> shift) + 1) << shift);
+                piece_end = block_end < piece_end ? block_end : piece_end;
+            } else if (extent->kind == EXTENT_COPY) {
+                uint64_t slot_end = window->offset +
+                    ((pos - window->offset) / BUFFER_SEGMENT_DATA_SIZE + 1) * BUFFER_SEGMENT_DATA_SIZE;
+                piece_end = slot_end < piece_end ? slot_end : piece_end;
+            }
+            if (!grow_array((void**)&window->jobs, &window->job_cap, window->job_count,
+                            sizeof(DecompressJob))) {
+                return false;
+            }
+            DecompressJob *job = &window->jobs[window->job_count++];
+            job->extent = extent;
+            job->offset = pos;
+            job->size = piece_end - pos;
+            pos = piece_end;
+        }
+    }
+    return true;
+}
+
+/* Send a range of a compressed title as its decompressed bytes. The range
+ * goes out in windows of half the queue depth: while one window is in
+ * flight, the pool fills the slots of the next. */
+static int stream_range_decompressed(UsbContext *ctx, const char *path, uint64_t offset, uint64_t size) {
+    int fd;
+    DecompressedTitle *title = decompressed_title_acquire(path, &fd);
+    if (!title) {
+        return -1;
+    }
+    if (offset > title->size || size > title->size - offset) {
+        LOG_ERROR("Range past the end of decompressed %s (%lu bytes)", path, (unsigned long)title->size);
+        decompressed_title_release(title, fd);
+        return -1;
+    }
+
+    DecompressWindow window = { .title = title, .fd = fd };
+    int batch = ctx->tx.depth / 2 > 0 ? ctx->tx.depth / 2 : 1;
+    int ret = 0;
+
+    for (uint64_t done = 0; done < size && ret == 0; ) {
+        uint64_t len = size - done;
+        if (len > (uint64_t)batch * BUFFER_SEGMENT_DATA_SIZE) {
+            len = (uint64_t)batch * BUFFER_SEGMENT_DATA_SIZE;
+        }
+        int slots = (len + BUFFER_SEGMENT_DATA_SIZE - 1) / BUFFER_SEGMENT_DATA_SIZE;
+        for (int i = 0; i < slots && ret == 0; i++) {
+            window.slots[i] = usb_tx_acquire(ctx);
+            if (!window.slots[i]) {
+                ret = -1;
+            }
+        }
+        window.offset = offset + done;
+        window.size = len;
+        if (ret < 0 || !decompress_window_plan(&window)) {
+            ret = -1;
+            break;
+        }
+
+        if (decompress_pool_run(&window) < 0) {
+            LOG_ERROR("Failed to decompress %s at %lu", path, (unsigned long)window.offset);
+            ret = -1;
+            break;
+        }
+
+        for (int i = 0; i < slots && ret == 0; i++) {
+            uint64_t chunk = len - (uint64_t)i * BUFFER_SEGMENT_DATA_SIZE;
+            if (chunk > BUFFER_SEGMENT_DATA_SIZE) {
+                chunk = BUFFER_SEGMENT_DATA_SIZE;
+            }
+            if (usb_tx_submit(ctx, window.slots[i], window.slots[i]->buffer, chunk) < 0) {
+                ret = -1;
+            }
+        }
+        done += len;
+    }
+
+    if (usb_tx_flush(ctx) < 0) {
+        ret = -1;
+    }
+    free(window.jobs);
+    decompressed_title_release(title, fd);
+    return ret;
+}
+
+/* Size of the title at path once decompressed, 0 if it cannot be read */
+static uint64_t decompressed_title_size(const char *path) {
+    int fd;
+    DecompressedTitle *title = decompressed_title_acquire(path, &fd);
+    if (!title) {
+        return 0;
+    }
+    uint64_t size = title->size;
+    decompressed_title_release(title, fd);
+    return size;
+}
+
+/* Whether display_name is the decompressed name of the title at path */
+static bool title_served_decompressed(const char *display_name, const char *path) {
+    char compressed[MAX_PATH_LEN];
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    return swap_title_extension(display_name, true, compressed, sizeof(compressed)) &&
+           strcmp(base, compressed) == 0;
+}
+#endif
 
-    cache->count = 0;
-    scan_directory(work_dir, cache);
+/* Send size bytes of path starting at offset using the configured read path */
+static int stream_file_range(UsbContext *ctx, const char *path, uint64_t offset, uint64_t size) {
+    int ret;
+#ifndef _WIN32
+    if (use_mmap && !use_direct_io) {
+        ret = stream_range_mapped(ctx, path, offset, size);
+        if (ret <= 0) {
+            return ret;
+        }
+        LOG_DEBUG("Cannot map %s, falling back to buffered reads", path);
+    }
+#endif
+#ifdef HAVE_LIBURING
+    if (use_io_uring && !use_direct_io) {
+        ret = stream_range_uring(ctx, path, offset, size);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+#endif
 
-    char *nsp_list = malloc(MAX_TITLES * 256);
-    if (!nsp_list) {
-        LOG_ERROR("Failed to allocate memory for title list");
-        return;
+    RangeSource src = { .fd = -1, .offset = offset, .size = size };
+    if (range_source_open(&src, path) < 0) {
+        LOG_ERROR("Failed to open file: %s", path);
+        return -1;
     }
 
-    nsp_list[0] = '\0';
-    for (int i = 0; i < cache->count; i++) {
-        strcat(nsp_list, cache->entries[i].display_name);
-        strcat(nsp_list, "\n");
+    if (read_buffers > 0 && size > BUFFER_SEGMENT_DATA_SIZE) {
+        ret = stream_range_pipelined(ctx, &src);
+    } else {
+        ret = stream_range_serial(ctx, &src);
     }
+    range_source_close(&src);
+    return ret;
+}
 
-    uint32_t list_len = strlen(nsp_list);
+/* Send a range of one file: from the prefetch buffer when it holds the
+ * range, through the block cache when small enough to be metadata, streamed
+ * otherwise; DBI's 1MB content ranges must not push headers out */
+static int serve_file_range(UsbContext *ctx, const char *path, uint64_t offset, uint32_t size) {
+    const uint8_t *prefetched = use_prefetch ? prefetch_acquire(path, offset, size) : NULL;
+    int ret;
+    if (prefetched) {
+        ret = stream_range_memory(ctx, prefetched, size);
+        prefetch_release(path);
+    } else if (block_cache.shard_count > 0 && size > 0 && size <= BLOCK_CACHE_MAX_RANGE) {
+        ret = stream_range_cached(ctx, path, offset, size);
+    } else {
+        ret = stream_file_range(ctx, path, offset, size);
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    if (use_prefetch) {
+        uint64_t file_size;
+        bool drop_cache;
+        int fd = fd_cache_acquire(path, use_direct_io, &file_size, &drop_cache);
+        if (fd >= 0) {
+            fd_cache_release(fd);
+            prefetch_note_range(path, offset, size, file_size);
+        }
+    }
+    return 0;
+}
 
-    uint8_t response[16];
-    memcpy(response, "DBI0", 4);
-    *(uint32_t*)(response + 4) = CMD_TYPE_RESPONSE;
-    *(uint32_t*)(response + 8) = CMD_LIST;
-    *(uint32_t*)(response + 12) = list_len;
-    usb_write(ctx, response, 16, USB_TIMEOUT);
+/* Send a range of a split title. A range within one part is served like
+ * any file; one crossing parts is streamed as a single reply, its chunks
+ * running on from one part into the next. */
+static int serve_split_range(UsbContext *ctx, const SplitTitle *split, uint64_t offset, uint32_t size) {
+    if (offset > split->size || size > split->size - offset) {
+        LOG_ERROR("Range past the end of split title %s (%lu bytes)",
+                  split->path, (unsigned long)split->size);
+        return -1;
+    }
+    LOG_DEBUG("Split title %s: %u parts", split->path, split->count);
 
-    uint8_t ack[16];
-    usb_read(ctx, ack, 16, USB_TIMEOUT);
-    uint32_t cmd_type = *(uint32_t*)(ack + 4);
-    uint32_t cmd_id = *(uint32_t*)(ack + 8);
-    uint32_t data_size = *(uint32_t*)(ack + 12);
-    LOG_DEBUG("Cmd Type: %u, Command id: %u, Data size: %u", cmd_type, cmd_id, data_size);
-    LOG_DEBUG("Ack");
+    uint64_t start = 0;
+    uint32_t i = 0;
+    while (i + 1 < split->count && offset >= start + split->sizes[i]) {
+        start += split->sizes[i++];
+    }
+    if (offset + size <= start + split->sizes[i]) {
+        char part[MAX_PATH_LEN];
+        return split_part_path(split->path, split->dir, i, part) ?
+               serve_file_range(ctx, part, offset - start, size) : -1;
+    }
 
-    usb_write(ctx, (uint8_t*)nsp_list, list_len, USB_TIMEOUT);
-    free(nsp_list);
+    RangeSource src = { .fd = -1, .direct = use_direct_io, .offset = offset, .size = size, .split = split };
+    int ret = read_buffers > 0 && size > BUFFER_SEGMENT_DATA_SIZE ?
+              stream_range_pipelined(ctx, &src) : stream_range_serial(ctx, &src);
+    range_source_close(&src);
+    return ret;
 }
 
 /* Process FILE_RANGE command */
-void process_file_range_command(UsbContext *ctx, uint32_t data_size, TitleCache *cache) {
+void process_file_range_command(UsbContext *ctx, uint32_t data_size) {
     LOG_INFO("File range");
 
     uint8_t ack_header[16];
@@ -287,24 +5803,42 @@ void process_file_range_command(UsbContext *ctx, uint32_t data_size, TitleCache
     *(uint32_t*)(ack_header + 12) = data_size;
     usb_write(ctx, ack_header, 16, USB_TIMEOUT);
 
+    if (data_size < 16) {
+        LOG_ERROR("File range header too short: %u bytes", data_size);
+        return;
+    }
+
     uint8_t *file_range_header = malloc(data_size);
     if (!file_range_header) {
         LOG_ERROR("Failed to allocate memory for file range header");
         return;
     }
 
-    usb_read(ctx, file_range_header, data_size, USB_TIMEOUT);
+    if (usb_read(ctx, file_range_header, data_size, USB_TIMEOUT) != (int)data_size) {
+        LOG_ERROR("Failed to read file range header");
+        free(file_range_header);
+        return;
+    }
 
     uint32_t range_size = *(uint32_t*)(file_range_header);
     uint64_t range_offset = *(uint64_t*)(file_range_header + 4);
     uint32_t nsp_name_len = *(uint32_t*)(file_range_header + 12);
+    /* The name is not NUL-terminated; its length is bounded by the header */
+    uint32_t name_copy = nsp_name_len;
+    if (name_copy > data_size - 16) {
+        name_copy = data_size - 16;
+    }
+    if (name_copy > MAX_PATH_LEN - 1) {
+        name_copy = MAX_PATH_LEN - 1;
+    }
     char nsp_name[MAX_PATH_LEN];
-    strncpy(nsp_name, (char*)(file_range_header + 16), MAX_PATH_LEN - 1);
-    nsp_name[MAX_PATH_LEN - 1] = '\0';
+    memcpy(nsp_name, file_range_header + 16, name_copy);
+    nsp_name[name_copy] = '\0';
 
     free(file_range_header);
 
-    const char *actual_path = find_title_path(cache, nsp_name);
+    char path_buf[MAX_PATH_LEN];
+    const char *actual_path = library_find_path(nsp_name, path_buf);
     LOG_INFO("Range Size: %u, Range Offset: %lu, Name len: %u, Name: %s", 
              range_size, range_offset, nsp_name_len, actual_path);
 
@@ -316,60 +5850,58 @@ void process_file_range_command(UsbContext *ctx, uint32_t data_size, TitleCache
     usb_write(ctx, response, 16, USB_TIMEOUT);
 
     uint8_t ack[16];
-    usb_read(ctx, ack, 16, USB_TIMEOUT);
+    if (usb_read(ctx, ack, 16, USB_TIMEOUT) != 16) {
+        LOG_ERROR("File range not acknowledged");
+        return;
+    }
     uint32_t cmd_type = *(uint32_t*)(ack + 4);
     uint32_t cmd_id = *(uint32_t*)(ack + 8);
     uint32_t ack_data_size = *(uint32_t*)(ack + 12);
     LOG_DEBUG("Cmd Type: %u, Command id: %u, Data size: %u", cmd_type, cmd_id, ack_data_size);
     LOG_DEBUG("Ack");
 
-    FILE *f = fopen(actual_path, "rb");
-    if (!f) {
-        LOG_ERROR("Failed to open file: %s", actual_path);
-        return;
-    }
-
-    fseek(f, range_offset, SEEK_SET);
-
-    uint8_t *buffer = malloc(BUFFER_SEGMENT_DATA_SIZE);
-    if (!buffer) {
-        LOG_ERROR("Failed to allocate transfer buffer");
-        fclose(f);
+#ifdef HAVE_ZSTD
+    if (use_decompress && title_served_decompressed(nsp_name, actual_path)) {
+        if (stream_range_decompressed(ctx, actual_path, range_offset, range_size) < 0) {
+            LOG_ERROR("File range transfer aborted");
+            ctx->lost = true;
+        }
         return;
     }
+#endif
 
-    uint64_t curr_off = 0;
-    uint64_t end_off = range_size;
-    uint32_t read_size = BUFFER_SEGMENT_DATA_SIZE;
-
-    while (curr_off < end_off) {
-        if (curr_off + read_size >= end_off) {
-            read_size = end_off - curr_off;
-        }
-
-        size_t bytes_read = fread(buffer, 1, read_size, f);
-        if (bytes_read != read_size) {
-            LOG_ERROR("Failed to read from file");
-            break;
-        }
-
-        usb_write(ctx, buffer, read_size, USB_TIMEOUT);
-        curr_off += read_size;
+    SplitTitle split;
+    int ret = split_title_parts(actual_path, &split) > 0 ?
+              serve_split_range(ctx, &split, range_offset, range_size) :
+              serve_file_range(ctx, actual_path, range_offset, range_size);
+    /* The Switch still waits for the rest of range_size bytes, so a short
+     * reply can only be resolved by resetting the link */
+    if (ret < 0) {
+        LOG_ERROR("File range transfer aborted");
+        ctx->lost = true;
     }
-
-    free(buffer);
-    fclose(f);
 }
 
-/* Main command polling loop */
-void poll_commands(UsbContext *ctx, const char *work_dir) {
+/* Main command polling loop. Returns 0 when the Switch ends the session,
+ * -1 when the link was lost and the Switch should be reconnected. */
+int poll_commands(UsbContext *ctx) {
     LOG_INFO("Entering command loop");
 
-    TitleCache cache = {0};
-
     while (true) {
+        if (ctx->lost) {
+            LOG_INFO("Switch disconnected");
+            return -1;
+        }
+
+        /* Between commands both sides are in step, so a failed read can
+         * be recovered without reconnecting */
         uint8_t cmd_header[16];
-        int ret = usb_read(ctx, cmd_header, 16, USB_TIMEOUT);
+        int ret = ctx->transport->read(ctx, cmd_header, 16, USB_TIMEOUT);
+        if (ret < 0) {
+            LOG_ERROR("USB read error: %s", libusb_error_name(ret));
+            usb_recover(ctx, ctx->ep_in, ret);
+            continue;
+        }
         if (ret < 16) {
             continue;
         }
@@ -377,6 +5909,7 @@ void poll_commands(UsbContext *ctx, const char *work_dir) {
         if (memcmp(cmd_header, "DBI0", 4) != 0) {
             continue;
         }
+        ctx->faults = 0;
 
         uint32_t cmd_type = *(uint32_t*)(cmd_header + 4);
         uint32_t cmd_id = *(uint32_t*)(cmd_header + 8);
@@ -387,23 +5920,28 @@ void poll_commands(UsbContext *ctx, const char *work_dir) {
         switch (cmd_id) {
             case CMD_EXIT:
                 process_exit_command(ctx);
-                return;
+                return 0;
             case CMD_LIST:
-                process_list_command(ctx, work_dir, &cache);
+                process_list_command(ctx);
                 break;
             case CMD_FILE_RANGE:
-                process_file_range_command(ctx, data_size, &cache);
+                process_file_range_command(ctx, data_size);
                 break;
             default:
                 LOG_WARNING("Unknown command id: %u", cmd_id);
                 process_exit_command(ctx);
-                return;
+                return 0;
         }
     }
 }
 
 /* Connect to Nintendo Switch */
 UsbContext* connect_to_switch(void) {
+#ifdef HAVE_USB_HOTPLUG
+    if (use_hotplug) {
+        return usb_hotplug_wait();
+    }
+#endif
     UsbContext *ctx;
     while (true) {
         ctx = usb_init(SWITCH_VID, SWITCH_PID);
@@ -415,13 +5953,664 @@ UsbContext* connect_to_switch(void) {
     }
 }
 
+/* Release what a session held besides its USB transfers */
+static void session_close(UsbContext *ctx) {
+#ifndef _WIN32
+    mapped_title_close();
+#endif
+#ifdef HAVE_LIBURING
+    uring_reader_close();
+#endif
+    usb_cleanup(ctx);
+}
+
+/* Multi-console mode: every Switch gets a session thread running its own
+ * command loop, all of them sharing the title library, the fd cache and
+ * the prefetcher */
+typedef struct {
+    pthread_t thread;
+    UsbContext *ctx;
+    libusb_device *device;
+    int id;
+    bool active;
+    bool finished;
+} ConsoleSession;
+
+static ConsoleSession sessions[MAX_CONSOLES];
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static int next_session_id = 1;
+
+static void* session_thread(void *arg) {
+    ConsoleSession *session = arg;
+    poll_commands(session->ctx);
+    session_close(session->ctx);
+    LOG_INFO("Console %d: session ended", session->id);
+
+    pthread_mutex_lock(&sessions_lock);
+    session->finished = true;
+    pthread_mutex_unlock(&sessions_lock);
+    return NULL;
+}
+
+/* Whether a console is being served already */
+static bool session_busy(libusb_device *device) {
+    bool busy = false;
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < MAX_CONSOLES && !busy; i++) {
+        busy = sessions[i].active && sessions[i].device == device;
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    return busy;
+}
+
+/* Join finished sessions so their consoles can be served again */
+static void sessions_reap(bool wait) {
+    for (int i = 0; i < MAX_CONSOLES; i++) {
+        pthread_mutex_lock(&sessions_lock);
+        bool done = sessions[i].active && (sessions[i].finished || wait);
+        pthread_mutex_unlock(&sessions_lock);
+        if (!done) {
+            continue;
+        }
+        pthread_join(sessions[i].thread, NULL);
+        libusb_unref_device(sessions[i].device);
+        pthread_mutex_lock(&sessions_lock);
+        sessions[i].active = false;
+        pthread_mutex_unlock(&sessions_lock);
+    }
+}
+
+/* Open a console and start its session thread. Returns 0 when there is no
+ * free session slot, -1 when the console could not be opened. */
+static int session_start(libusb_context *usb, libusb_device *device, bool reset) {
+    ConsoleSession *session = NULL;
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < MAX_CONSOLES && !session; i++) {
+        if (!sessions[i].active) {
+            session = &sessions[i];
+        }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+    if (!session) {
+        return 0;
+    }
+
+    UsbContext *ctx = usb_open_device(usb, device, reset);
+    if (!ctx) {
+        return -1;
+    }
+    session->ctx = ctx;
+    session->device = libusb_ref_device(device);
+    session->id = next_session_id++;
+    session->finished = false;
+    LOG_INFO("Console %d: switch at bus %u address %u", session->id,
+             libusb_get_bus_number(device), libusb_get_device_address(device));
+
+    pthread_mutex_lock(&sessions_lock);
+    session->active = true;
+    pthread_mutex_unlock(&sessions_lock);
+    if (pthread_create(&session->thread, NULL, session_thread, session) != 0) {
+        LOG_ERROR("Failed to start session thread");
+        pthread_mutex_lock(&sessions_lock);
+        session->active = false;
+        pthread_mutex_unlock(&sessions_lock);
+        libusb_unref_device(session->device);
+        session_close(ctx);
+        return -1;
+    }
+    return 1;
+}
+
+/* Serve every attached Switch, each in its own session, until libusb fails */
+int serve_consoles(void) {
+    libusb_context *usb = NULL;
+#ifdef HAVE_USB_HOTPLUG
+    if (use_hotplug) {
+        usb = usb_hotplug.ctx;
+    }
+#endif
+    bool own_usb = !usb;
+    if (own_usb) {
+        int ret = libusb_init(&usb);
+        if (ret < 0) {
+            LOG_ERROR("Failed to initialize libusb: %s", libusb_error_name(ret));
+            return -1;
+        }
+    }
+
+    LOG_INFO("Waiting for switches");
+    int ret = 0;
+    while (ret == 0) {
+        sessions_reap(false);
+
+#ifdef HAVE_USB_HOTPLUG
+        if (use_hotplug) {
+            bool reset;
+            libusb_device *device;
+            while ((device = usb_hotplug_take(session_busy, &reset)) != NULL) {
+                int started = session_start(usb, device, reset);
+                if (started < 0) {
+                    usb_hotplug_reject(device);
+                }
+                libusb_unref_device(device);
+                if (started == 0) {
+                    break;
+                }
+            }
+            /* Wake up now and then to serve consoles again after EXIT */
+            struct timeval tv = { 1, 0 };
+            ret = libusb_handle_events_timeout_completed(usb, &tv, NULL);
+            if (ret == LIBUSB_ERROR_INTERRUPTED) {
+                ret = 0;
+            }
+            continue;
+        }
+#endif
+
+        libusb_device **list;
+        ssize_t count = libusb_get_device_list(usb, &list);
+        for (ssize_t i = 0; i < count; i++) {
+            struct libusb_device_descriptor desc;
+            if (libusb_get_device_descriptor(list[i], &desc) != 0 ||
+                desc.idVendor != SWITCH_VID || desc.idProduct != SWITCH_PID ||
+                session_busy(list[i])) {
+                continue;
+            }
+            if (session_start(usb, list[i], true) == 0) {
+                break;
+            }
+        }
+        if (count >= 0) {
+            libusb_free_device_list(list, 1);
+        }
+        sleep(1);
+    }
+
+    LOG_ERROR("Failed to wait for USB events: %s", libusb_error_name(ret));
+    sessions_reap(true);
+    if (own_usb) {
+        libusb_exit(usb);
+    }
+    return -1;
+}
+
+#ifndef _WIN32
+/* Simulated DBI client: drives the command loop over a socketpair the way
+ * DBI does, listing the titles and reading each one front to back in
+ * SIM_RANGE_SIZE requests. Title sizes come from the library, where DBI
+ * learns them from the container headers. Outside the timed passes the
+ * data is checked against the title files. */
+typedef struct {
+    const char *name;
+    char path[MAX_PATH_LEN];
+    uint64_t size;
+    bool decompressed;
+    uint64_t hash;
+} SimTitle;
+
+typedef struct {
+    int fd;
+    uint8_t *buffer;
+    uint8_t *reference;
+    char *list;
+    SimTitle *titles;
+    uint32_t title_count;
+    uint32_t title_cap;
+    bool timed;
+    double *latencies;
+    uint32_t latency_count;
+    uint32_t latency_cap;
+    uint64_t bytes;
+    uint32_t checked;
+} SimClient;
+
+static double sim_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Send a command header, then read the reply header and check it */
+static int sim_exchange(SimClient *client, uint32_t cmd_type, uint32_t cmd_id,
+                        uint32_t data_size, uint32_t *reply_size) {
+    uint8_t header[16];
+    memcpy(header, "DBI0", 4);
+    *(uint32_t*)(header + 4) = cmd_type;
+    *(uint32_t*)(header + 8) = cmd_id;
+    *(uint32_t*)(header + 12) = data_size;
+    if (sock_transfer(client->fd, header, 16, true) < 0 ||
+        sock_transfer(client->fd, header, 16, false) < 0) {
+        return -1;
+    }
+    if (memcmp(header, "DBI0", 4) != 0 || *(uint32_t*)(header + 8) != cmd_id) {
+        LOG_ERROR("Simulated client got an unexpected reply to command %u", cmd_id);
+        return -1;
+    }
+    *reply_size = *(uint32_t*)(header + 12);
+    return 0;
+}
+
+/* Send the ack for a response and read the payload that follows */
+static int sim_receive(SimClient *client, uint32_t cmd_id, uint8_t *data, uint32_t size) {
+    uint8_t ack[16];
+    memcpy(ack, "DBI0", 4);
+    *(uint32_t*)(ack + 4) = CMD_TYPE_ACK;
+    *(uint32_t*)(ack + 8) = cmd_id;
+    *(uint32_t*)(ack + 12) = 0;
+    if (sock_transfer(client->fd, ack, 16, true) < 0) {
+        return -1;
+    }
+    return size ? sock_transfer(client->fd, data, size, false) : 0;
+}
+
+static char* sim_list(SimClient *client, uint32_t *list_len) {
+    if (sim_exchange(client, CMD_TYPE_REQUEST, CMD_LIST, 0, list_len) < 0) {
+        return NULL;
+    }
+    char *list = malloc(*list_len + 1);
+    if (!list) {
+        return NULL;
+    }
+    if (sim_receive(client, CMD_LIST, (uint8_t*)list, *list_len) < 0) {
+        free(list);
+        return NULL;
+    }
+    list[*list_len] = '\0';
+    return list;
+}
+
+/* Read a range of a title into buf; only timed reads count in the report */
+static int sim_file_range(SimClient *client, const char *name, uint64_t offset, uint32_t size,
+                          uint8_t *buf) {
+    uint32_t name_len = strlen(name);
+    uint8_t header[16 + MAX_PATH_LEN];
+    *(uint32_t*)header = size;
+    *(uint64_t*)(header + 4) = offset;
+    *(uint32_t*)(header + 12) = name_len;
+    memcpy(header + 16, name, name_len);
+
+    double start = sim_now();
+    uint32_t reply_size;
+    if (sim_exchange(client, CMD_TYPE_REQUEST, CMD_FILE_RANGE, 16 + name_len, &reply_size) < 0 ||
+        sock_transfer(client->fd, header, 16 + name_len, true) < 0) {
+        return -1;
+    }
+    uint8_t response[16];
+    if (sock_transfer(client->fd, response, 16, false) < 0 ||
+        *(uint32_t*)(response + 12) != size ||
+        sim_receive(client, CMD_FILE_RANGE, buf, size) < 0) {
+        LOG_ERROR("Simulated read of %s at %lu failed", name, (unsigned long)offset);
+        return -1;
+    }
+    if (!client->timed) {
+        return 0;
+    }
+
+    if (!grow_array((void**)&client->latencies, &client->latency_cap,
+                    client->latency_count, sizeof(double))) {
+        return -1;
+    }
+    client->latencies[client->latency_count++] = sim_now() - start;
+    client->bytes += size;
+    return 0;
+}
+
+/* FNV-1a over the 64-bit words of a title's stream; ranges read front to
+ * back are multiples of 8 bytes but for the last, so the hash does not
+ * depend on the range size */
+#define SIM_HASH_SEED 0xcbf29ce484222325ULL
+
+static uint64_t sim_hash(uint64_t hash, const uint8_t *data, uint32_t size) {
+    uint32_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Read size bytes of a title at offset straight from its files */
+static int sim_reference_file(const char *path, uint64_t offset, uint32_t size, uint8_t *buf) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t done = pread_full(fd, buf, size, offset);
+    close(fd);
+    return done == (ssize_t)size ? 0 : -1;
+}
+
+static int sim_reference(const SimTitle *title, uint64_t offset, uint32_t size, uint8_t *buf) {
+    SplitTitle split;
+    if (split_title_scan(title->path, &split) == 0) {
+        return sim_reference_file(title->path, offset, size, buf);
+    }
+    uint64_t start = 0;
+    for (uint32_t i = 0; i < split.count && size > 0; start += split.sizes[i++]) {
+        if (offset >= start + split.sizes[i]) {
+            continue;
+        }
+        uint64_t piece = start + split.sizes[i] - offset;
+        if (piece > size) {
+            piece = size;
+        }
+        char part[MAX_PATH_LEN];
+        if (!split_part_path(split.path, split.dir, i, part) ||
+            sim_reference_file(part, offset - start, (uint32_t)piece, buf) < 0) {
+            return -1;
+        }
+        buf += piece;
+        offset += piece;
+        size -= (uint32_t)piece;
+    }
+    return size == 0 ? 0 : -1;
+}
+
+/* Check a reply held in client->buffer. Raw titles are compared with their
+ * files; a decompressed title, for ranges of up to a segment, with the
+ * same bytes inside a range from the start of their segment. */
+static int sim_check(SimClient *client, const SimTitle *title, uint64_t offset, uint32_t size) {
+    uint32_t skip = 0;
+    int ret;
+    if (title->decompressed) {
+        uint64_t from = offset & ~(uint64_t)(BUFFER_SEGMENT_DATA_SIZE - 1);
+        skip = offset - from;
+        ret = sim_file_range(client, title->name, from, skip + size, client->reference);
+    } else {
+        ret = sim_reference(title, offset, size, client->reference);
+    }
+    if (ret < 0) {
+        LOG_ERROR("Cannot read %s at %lu to check it", title->name, (unsigned long)offset);
+        return -1;
+    }
+    client->checked++;
+    if (memcmp(client->buffer, client->reference + skip, size) != 0) {
+        LOG_ERROR("Simulated read of %s at %lu (%u bytes) returned wrong data",
+                  title->name, (unsigned long)offset, size);
+        return -1;
+    }
+    return 0;
+}
+
+/* Read a title front to back in ranges of range_size, hashing the stream */
+static int sim_stream_title(SimClient *client, const SimTitle *title, uint32_t range_size,
+                            bool check, uint64_t *hash) {
+    *hash = SIM_HASH_SEED;
+    for (uint64_t off = 0; off < title->size; off += range_size) {
+        uint32_t size = title->size - off < range_size ? title->size - off : range_size;
+        if (sim_file_range(client, title->name, off, size, client->buffer) < 0 ||
+            (check && !title->decompressed && sim_check(client, title, off, size) < 0)) {
+            return -1;
+        }
+        *hash = sim_hash(*hash, client->buffer, size);
+    }
+    return 0;
+}
+
+/* Header-sized and small ranges around a point of a title */
+static int sim_probe(SimClient *client, const SimTitle *title, uint64_t point) {
+    static const uint32_t before[] = { 0, 8, 256, 65536 };
+    static const uint32_t sizes[] = { 16, 16, 512, 131072 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint64_t off = point > before[i] ? point - before[i] : 0;
+        if (off >= title->size) {
+            continue;
+        }
+        uint32_t size = title->size - off < sizes[i] ? title->size - off : sizes[i];
+        if (sim_file_range(client, title->name, off, size, client->buffer) < 0 ||
+            sim_check(client, title, off, size) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Read a title again in the 1MB ranges DBI streams with and check every
+ * reply and the stream against the timed passes, then probe small ranges
+ * at the start, at each part boundary and through the title */
+static int sim_verify_title(SimClient *client, const SimTitle *title) {
+    uint64_t hash;
+    if (sim_stream_title(client, title, BUFFER_SEGMENT_DATA_SIZE, true, &hash) < 0) {
+        return -1;
+    }
+    if (hash != title->hash) {
+        LOG_ERROR("Simulated reads of %s differ between range sizes", title->name);
+        return -1;
+    }
+
+    SplitTitle split;
+    uint64_t start = 0;
+    if (!title->decompressed && split_title_scan(title->path, &split) > 0) {
+        for (uint32_t i = 1; i < split.count; i++) {
+            start += split.sizes[i - 1];
+            if (sim_probe(client, title, start) < 0) {
+                return -1;
+            }
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        if (sim_probe(client, title, title->size * i / 8) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Look up what the listing names: its path, size and how it is served */
+static bool sim_title_open(SimTitle *title) {
+    struct stat st;
+    char path_buf[MAX_PATH_LEN];
+    const char *path = library_find_path(title->name, path_buf);
+    snprintf(title->path, sizeof(title->path), "%s", path);
+    if (stat(path, &st) != 0) {
+        LOG_WARNING("Cannot stat %s, skipping", path);
+        return false;
+    }
+    SplitTitle split;
+    title->size = split_title_parts(path, &split) > 0 ? split.size : (uint64_t)st.st_size;
+    title->decompressed = false;
+#ifdef HAVE_ZSTD
+    if (use_decompress && title_served_decompressed(title->name, path)) {
+        title->size = decompressed_title_size(path);
+        title->decompressed = true;
+    }
+#endif
+    return true;
+}
+
+/* Read every listed title passes times over client's socket; the first
+ * pass records each title's hash and later ones must match it */
+static int sim_run(SimClient *client, int passes) {
+    double start = sim_now();
+    uint32_t list_len;
+    client->list = sim_list(client, &list_len);
+    if (!client->list) {
+        return -1;
+    }
+    LOG_INFO("Simulated LIST: %u bytes in %.1fms", list_len, (sim_now() - start) * 1e3);
+
+    char *save;
+    for (char *name = strtok_r(client->list, "\n", &save); name; name = strtok_r(NULL, "\n", &save)) {
+        if (!grow_array((void**)&client->titles, &client->title_cap,
+                        client->title_count, sizeof(SimTitle))) {
+            return -1;
+        }
+        SimTitle *title = &client->titles[client->title_count];
+        title->name = name;
+        if (sim_title_open(title)) {
+            client->title_count++;
+        }
+    }
+
+    client->timed = true;
+    for (int pass = 0; pass < passes; pass++) {
+        for (uint32_t i = 0; i < client->title_count; i++) {
+            SimTitle *title = &client->titles[i];
+            uint64_t hash;
+            if (sim_stream_title(client, title, SIM_RANGE_SIZE, false, &hash) < 0) {
+                return -1;
+            }
+            if (pass == 0) {
+                title->hash = hash;
+            } else if (hash != title->hash) {
+                LOG_ERROR("Simulated pass %d read different data for %s", pass + 1, title->name);
+                return -1;
+            }
+        }
+    }
+    client->timed = false;
+    return 0;
+}
+
+/* Check what the timed passes read, outside the measured time */
+static int sim_verify(SimClient *client) {
+    for (uint32_t i = 0; i < client->title_count; i++) {
+        if (sim_verify_title(client, &client->titles[i]) < 0) {
+            return -1;
+        }
+    }
+    LOG_INFO("Simulated client checked %u titles, %u ranges", client->title_count, client->checked);
+
+    uint32_t exit_size;
+    sim_exchange(client, CMD_TYPE_REQUEST, CMD_EXIT, 0, &exit_size);
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* The mapping and io_uring reader are per thread, so the server thread
+ * releases its session itself, as session_thread does */
+static void* sim_server_thread(void *arg) {
+    UsbContext *ctx = arg;
+    poll_commands(ctx);
+    session_close(ctx);
+    return NULL;
+}
+
+/* Serve the simulated client from the regular command loop and report the
+ * throughput and per-range latency it saw */
+int simulate_client(int passes) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        LOG_ERROR("Failed to create socket pair: %s", strerror(errno));
+        return -1;
+    }
+
+    UsbContext *ctx = calloc(1, sizeof(UsbContext));
+    SimClient client = { .fd = fds[1], .buffer = malloc(SIM_RANGE_SIZE),
+                         .reference = malloc(SIM_RANGE_SIZE) };
+    if (!ctx || !client.buffer || !client.reference) {
+        LOG_ERROR("Failed to allocate simulated session");
+        free(ctx);
+        free(client.buffer);
+        free(client.reference);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    ctx->transport = &socket_transport;
+    ctx->fd = fds[0];
+    if (usb_tx_ring_init(ctx, usb_queue_depth, read_buffers) < 0) {
+        usb_tx_ring_free(ctx);
+        free(ctx);
+        free(client.buffer);
+        free(client.reference);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    pthread_t server;
+    if (pthread_create(&server, NULL, sim_server_thread, ctx) != 0) {
+        LOG_ERROR("Failed to start simulated server");
+        usb_cleanup(ctx);
+        free(client.buffer);
+        free(client.reference);
+        close(fds[1]);
+        return -1;
+    }
+
+    double start = sim_now();
+    int ret = sim_run(&client, passes);
+    double elapsed = sim_now() - start;
+    if (ret == 0) {
+        ret = sim_verify(&client);
+    }
+    /* Closing the client side ends the command loop if the run failed */
+    close(client.fd);
+    pthread_join(server, NULL);
+
+    if (ret == 0 && client.latency_count > 0) {
+        qsort(client.latencies, client.latency_count, sizeof(double), compare_double);
+        uint32_t n = client.latency_count;
+        LOG_INFO("Simulated %u ranges, %.1f MB in %.2fs: %.1f MB/s", n,
+                 client.bytes / 1e6, elapsed, client.bytes / 1e6 / elapsed);
+        LOG_INFO("Range latency: p50 %.2fms, p99 %.2fms, max %.2fms",
+                 client.latencies[n / 2] * 1e3, client.latencies[n * 99 / 100] * 1e3,
+                 client.latencies[n - 1] * 1e3);
+    }
+    free(client.latencies);
+    free(client.titles);
+    free(client.list);
+    free(client.buffer);
+    free(client.reference);
+    return ret;
+}
+#endif
+
 /* Print usage */
 void print_usage(const char *prog_name) {
     printf("Usage: %s [OPTIONS] <titles_directory>\n", prog_name);
     printf("\nInstall local titles into Nintendo Switch via USB\n");
     printf("\nOptions:\n");
-    printf("  --debug    Enable debug output\n");
-    printf("  --help     Show this help message\n");
+    printf("  --debug              Enable debug output\n");
+    printf("  --queue-depth <n>    USB transfers kept in flight (1-%d, default %d)\n",
+           USB_MAX_QUEUE_DEPTH, USB_DEFAULT_QUEUE_DEPTH);
+    printf("  --read-buffers <n>   1MB buffers the reader thread fills ahead of USB\n");
+    printf("                       (0-%d, 0 reads inline, default %d)\n",
+           MAX_READ_BUFFERS, DEFAULT_READ_BUFFERS);
+    printf("  --mmap               Serve titles from memory-mapped files (no read copy)\n");
+#ifdef HAVE_LIBURING
+    printf("  --io-uring           Read titles through io_uring with reads queued ahead\n");
+#endif
+#ifdef __linux__
+    printf("  --direct             Stream titles with O_DIRECT, leaving the page cache alone\n");
+#endif
+    printf("  --prefetch           Read the next range of sequential FILE_RANGE streams ahead\n");
+    printf("  --fd-cache <n>       Title files kept open between requests (0-%d, default %d)\n",
+           FD_CACHE_MAX_SIZE, FD_CACHE_DEFAULT_SIZE);
+    printf("  --block-cache <MB>   Memory for blocks of small reads kept between requests\n");
+    printf("                       (0-%d, 0 disables, default %d)\n",
+           BLOCK_CACHE_MAX_MB, BLOCK_CACHE_DEFAULT_MB);
+    printf("  --prewarm            Read every title's container headers into the block cache\n");
+    printf("                       in the background after scanning\n");
+#ifdef HAVE_ZSTD
+    printf("  --decompress         List NSZ/XCZ titles as NSP/XCI and decompress them here,\n");
+    printf("                       sparing the console the work\n");
+    printf("  --decompress-threads <n>\n");
+    printf("                       Threads decompressing NCZ blocks (1-%d, default %d)\n",
+           MAX_DECOMPRESS_THREADS, DEFAULT_DECOMPRESS_THREADS);
+#endif
+    printf("  --scan-threads <n>   Threads walking the titles directory (1-%d, default %d)\n",
+           MAX_SCAN_THREADS, DEFAULT_SCAN_THREADS);
+    printf("  --index-file <path>  Keep the title index in path to skip rescanning on restart\n");
+#ifdef HAVE_USB_HOTPLUG
+    printf("  --hotplug            Wait for the Switch with USB hotplug events and keep serving\n");
+    printf("                       sessions instead of exiting after the first\n");
+#endif
+    printf("  --multi              Serve every connected Switch at once, each in its own session\n");
+#ifndef _WIN32
+    printf("  --simulate <n>       Serve an in-process simulated client reading every title\n");
+    printf("                       n times and report throughput instead of using USB\n");
+#endif
+    printf("  --help               Show this help message\n");
 }
 
 /* Main function */
@@ -436,6 +6625,93 @@ int main(int argc, char *argv[]) {
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--debug") == 0) {
             debug_mode = true;
+        } else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc) {
+            usb_queue_depth = atoi(argv[++i]);
+            if (usb_queue_depth < 1 || usb_queue_depth > USB_MAX_QUEUE_DEPTH) {
+                LOG_ERROR("Queue depth must be between 1 and %d", USB_MAX_QUEUE_DEPTH);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--read-buffers") == 0 && i + 1 < argc) {
+            read_buffers = atoi(argv[++i]);
+            if (read_buffers < 0 || read_buffers > MAX_READ_BUFFERS) {
+                LOG_ERROR("Read buffers must be between 0 and %d", MAX_READ_BUFFERS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--mmap") == 0) {
+#ifndef _WIN32
+            use_mmap = true;
+#else
+            LOG_WARNING("--mmap is not supported on this platform");
+#endif
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+#ifdef HAVE_LIBURING
+            use_io_uring = true;
+#else
+            LOG_WARNING("--io-uring is not available in this build");
+#endif
+        } else if (strcmp(argv[i], "--direct") == 0) {
+#ifdef __linux__
+            use_direct_io = true;
+#else
+            LOG_WARNING("--direct is not supported on this platform");
+#endif
+        } else if (strcmp(argv[i], "--prefetch") == 0) {
+            use_prefetch = true;
+        } else if (strcmp(argv[i], "--fd-cache") == 0 && i + 1 < argc) {
+            fd_cache_size = atoi(argv[++i]);
+            if (fd_cache_size < 0 || fd_cache_size > FD_CACHE_MAX_SIZE) {
+                LOG_ERROR("File handle cache size must be between 0 and %d", FD_CACHE_MAX_SIZE);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--block-cache") == 0 && i + 1 < argc) {
+            block_cache_mb = atoi(argv[++i]);
+            if (block_cache_mb < 0 || block_cache_mb > BLOCK_CACHE_MAX_MB) {
+                LOG_ERROR("Block cache size must be between 0 and %d MB", BLOCK_CACHE_MAX_MB);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--prewarm") == 0) {
+            use_prewarm = true;
+        } else if (strcmp(argv[i], "--decompress") == 0) {
+#ifdef HAVE_ZSTD
+            use_decompress = true;
+#else
+            LOG_WARNING("--decompress is not available in this build");
+#endif
+        } else if (strcmp(argv[i], "--decompress-threads") == 0 && i + 1 < argc) {
+            int threads = atoi(argv[++i]);
+            if (threads < 1 || threads > MAX_DECOMPRESS_THREADS) {
+                LOG_ERROR("Decompress threads must be between 1 and %d", MAX_DECOMPRESS_THREADS);
+                return 1;
+            }
+#ifdef HAVE_ZSTD
+            decompress_threads = threads;
+#endif
+        } else if (strcmp(argv[i], "--scan-threads") == 0 && i + 1 < argc) {
+            scan_threads = atoi(argv[++i]);
+            if (scan_threads < 1 || scan_threads > MAX_SCAN_THREADS) {
+                LOG_ERROR("Scan threads must be between 1 and %d", MAX_SCAN_THREADS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--index-file") == 0 && i + 1 < argc) {
+            index_file_path = argv[++i];
+        } else if (strcmp(argv[i], "--hotplug") == 0) {
+#ifdef HAVE_USB_HOTPLUG
+            use_hotplug = true;
+#else
+            LOG_WARNING("--hotplug is not available with this libusb");
+#endif
+        } else if (strcmp(argv[i], "--multi") == 0) {
+            multi_console = true;
+        } else if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc) {
+            simulate_passes = atoi(argv[++i]);
+            if (simulate_passes < 1) {
+                LOG_ERROR("Simulated passes must be at least 1");
+                return 1;
+            }
+#ifdef _WIN32
+            LOG_WARNING("--simulate is not supported on this platform");
+            simulate_passes = 0;
+#endif
         } else if (strcmp(argv[i], "--help") == 0) {
             print_usage(argv[0]);
             return 0;
@@ -456,14 +6732,67 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    UsbContext *ctx = connect_to_switch();
-    if (!ctx) {
-        LOG_ERROR("Failed to connect to Switch");
-        return 1;
+    fd_cache_init(fd_cache_size);
+    block_cache_init((uint64_t)block_cache_mb << 20);
+    library_open(titles_dir);
+    if (use_prewarm) {
+        prewarm_start();
+    }
+#ifdef HAVE_USB_HOTPLUG
+    if (use_hotplug && usb_hotplug_start() < 0) {
+        use_hotplug = false;
+    }
+#endif
+
+    if (use_prefetch && prefetch_start(multi_console ? MAX_CONSOLES : 1) < 0) {
+        use_prefetch = false;
     }
+#ifdef HAVE_ZSTD
+    if (use_decompress && decompress_pool_start(decompress_threads) < 0) {
+        use_decompress = false;
+    }
+#endif
 
-    poll_commands(ctx, titles_dir);
+    /* In hotplug mode the process outlives sessions, waiting for the next.
+     * A lost link is reconnected in any mode, keeping the title index and
+     * the file caches. */
+    int status = 0;
+    if (simulate_passes > 0) {
+#ifndef _WIN32
+        status = simulate_client(simulate_passes) < 0;
+#endif
+    } else if (multi_console) {
+        status = serve_consoles() < 0;
+    } else {
+        bool lost;
+        do {
+            UsbContext *ctx = connect_to_switch();
+            if (!ctx) {
+                LOG_ERROR("Failed to connect to Switch");
+                status = 1;
+                break;
+            }
+            lost = poll_commands(ctx) < 0;
+            session_close(ctx);
+            if (lost) {
+                LOG_INFO("Reconnecting to switch");
+            }
+        } while (use_hotplug || lost);
+    }
 
-    usb_cleanup(ctx);
-    return 0;
+    if (use_prefetch) {
+        prefetch_stop();
+    }
+    prewarm_stop();
+    library_close();
+#ifdef HAVE_ZSTD
+    decompress_pool_stop();
+    decompressed_titles_free();
+#endif
+    block_cache_free();
+    fd_cache_free();
+#ifdef HAVE_USB_HOTPLUG
+    usb_hotplug_stop();
+#endif
+    return status;
 }